@@ -10,11 +10,16 @@
  */
 
 #define _XOPEN_SOURCE 700
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 #include "clock.h"
 
 int gverbose = 1;
@@ -106,3 +111,38 @@ double get_counter(void) {
     double delta_secs = get_timer();
     return delta_secs * cpu_mhz * 1e6;
 }
+
+/* Read the stamp counter.  The TSC ticks at a constant rate on current
+   x86 parts, and the ARM virtual counter always does; elsewhere fall back
+   on the nanosecond clock */
+uint64_t read_stamp(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Calibrate the stamp counter against the monotonic clock over 20 ms */
+double stamp_ticks_per_ns(void) {
+    static double ticks_per_ns = 0.0;
+    if (ticks_per_ns == 0.0) {
+        struct timespec t0, t1;
+        struct timespec pause = {0, 20000000};
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        uint64_t s0 = read_stamp();
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        uint64_t s1 = read_stamp();
+        double ns = 1e9 * (double)(t1.tv_sec - t0.tv_sec) +
+                    (double)(t1.tv_nsec - t0.tv_nsec);
+        ticks_per_ns = (double)(s1 - s0) / ns;
+    }
+    return ticks_per_ns;
+}
@@ -2,6 +2,8 @@
 #ifndef CLOCK_H
 #define CLOCK_H 1
 
+#include <stdint.h>
+
 /*  minimum resolution of timer (secs) */
 extern const double timer_resolution;
 
@@ -23,4 +25,12 @@ void start_counter(void);
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter(void);
 
+/* Stamps: cheap tick counts, for timing single calls */
+
+/* Read the stamp counter (the time stamp counter, where there is one) */
+uint64_t read_stamp(void);
+
+/* Number of stamp ticks per nanosecond, measured once against the clock */
+double stamp_ticks_per_ns(void);
+
 #endif
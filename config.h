@@ -131,6 +131,11 @@
  */
 #define TRY_DENSE_HEAP_START (void *)0x800000000
 
+/*
+ * Size of the huge pages that can back the heap (see mem_set_page_mode)
+ */
+#define HUGE_PAGE_SIZE (2UL << 20) /* 2 MB */
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
@@ -149,9 +154,23 @@
 #define SPARSE_PAGE_SIZE (1 << 10)
 
 /*
- * Maximum target load for hash table
+ * Maximum load of the page table (pages per slot).  The table uses open
+ * addressing, so this must be below 1
+ */
+#define HASH_LOAD 0.5
+
+/*
+ * Number of recently used pages cached in front of the page table (a power
+ * of two)
+ */
+#define PAGE_TLB_ENTRIES 64
+
+/*********** Parameters controlling both versions of heap ***********/
+
+/*
+ * Maximum number of arenas (sbrk-style heaps), including the heap itself
  */
-#define HASH_LOAD 10.0
+#define MAX_ARENAS 64
 
 /***************** Parameters for looking up reference throughput *********/
 /*
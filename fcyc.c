@@ -113,10 +113,54 @@ static void clear(void) {
     sink = x;
 }
 
+/* Start the counter or the timer */
+static void start_clock(bool cycles) {
+    if (cycles)
+        start_counter();
+    else
+        start_timer();
+}
+
+/* Read the counter or the timer */
+static double read_clock(bool cycles) {
+    return cycles ? get_counter() : get_timer();
+}
+
+/* Time reps calls of f, in seconds or (if cycles is set) clock cycles.
+   Without setup or teardown, one timer brackets all the calls; otherwise
+   each call is timed on its own, with setup run just before the timer
+   starts and teardown just after it stops */
+static double time_reps(test_funct f, test_funct setup, test_funct teardown,
+                        void *args, unsigned long reps, bool cycles) {
+    unsigned long r;
+    double total = 0.0;
+    if (setup == NULL && teardown == NULL) {
+        start_clock(cycles);
+        for (r = 0; r < reps; r++) {
+            f(args);
+        }
+        return read_clock(cycles);
+    }
+    for (r = 0; r < reps; r++) {
+        if (setup)
+            setup(args);
+        start_clock(cycles);
+        f(args);
+        total += read_clock(cycles);
+        if (teardown)
+            teardown(args);
+    }
+    return total;
+}
+
 double fcyc(test_funct f, void *args) {
+    return fcyc_setup(f, NULL, NULL, args);
+}
+
+double fcyc_setup(test_funct f, test_funct setup, test_funct teardown,
+                  void *args) {
     double result;
     unsigned long reps = min_reps;
-    unsigned long r;
     double cyc;
     /* Increase reps until get meaningful times */
     double sec = 0.0;
@@ -124,11 +168,7 @@ double fcyc(test_funct f, void *args) {
     while (sec < min_time) {
         if (clear_cache)
             clear();
-        start_timer();
-        for (r = 0; r < reps; r++) {
-            f(args);
-        }
-        sec = get_timer();
+        sec = time_reps(f, setup, teardown, args, reps, false);
         if (sec < min_time)
             reps += reps;
     }
@@ -136,11 +176,7 @@ double fcyc(test_funct f, void *args) {
     do {
         if (clear_cache)
             clear();
-        start_counter();
-        for (r = 0; r < reps; r++) {
-            f(args);
-        }
-        cyc = (double)get_counter() / (double)reps;
+        cyc = time_reps(f, setup, teardown, args, reps, true) / (double)reps;
         if (cyc > 0.0)
             add_sample(cyc);
     } while (!has_converged() && samplecount < maxsamples);
@@ -153,20 +189,20 @@ double fcyc(test_funct f, void *args) {
 }
 
 double fsec(test_funct f, void *args) {
+    return fsec_setup(f, NULL, NULL, args);
+}
+
+double fsec_setup(test_funct f, test_funct setup, test_funct teardown,
+                  void *args) {
     double result;
     /* Increase reps until we get meaningful times */
     unsigned long reps = min_reps;
-    unsigned long r;
     double sec = 0.0;
     init_min_time();
     while (sec < min_time) {
         if (clear_cache)
             clear();
-        start_timer();
-        for (r = 0; r < reps; r++) {
-            f(args);
-        }
-        sec = get_timer();
+        sec = time_reps(f, setup, teardown, args, reps, false);
         if (sec < min_time)
             reps += reps;
         //        printf("uSecs = %.3f, reps = %ld\n", sec * 1e6, reps);
@@ -176,11 +212,7 @@ double fsec(test_funct f, void *args) {
     do {
         if (clear_cache)
             clear();
-        start_timer();
-        for (r = 0; r < reps; r++) {
-            f(args);
-        }
-        sec = get_timer() / (double)reps;
+        sec = time_reps(f, setup, teardown, args, reps, false) / (double)reps;
         //        printf(" %.3f", sec * 1e6);
         if (sec > 0.0)
             add_sample(sec);
@@ -17,6 +17,14 @@ double fcyc(test_funct f, void *args);
 /* Compute number of cycles used by function f on given set of parameters */
 double fsec(test_funct f, void *args);
 
+/* As fcyc and fsec, but run setup before and teardown after each call of
+   f, outside the timed region.  Either may be NULL.  Each call is then
+   timed on its own, so f should take well over the timer resolution */
+double fcyc_setup(test_funct f, test_funct setup, test_funct teardown,
+                  void *args);
+double fsec_setup(test_funct f, test_funct setup, test_funct teardown,
+                  void *args);
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
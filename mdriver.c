@@ -30,10 +30,17 @@
 #include <sanitizer/msan_interface.h>
 #endif
 
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "clock.h"
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
 #include "mm.h"
+#include "perfctr.h"
 #include "stree.h"
 #include "tracefile.h"
 
@@ -50,6 +57,12 @@
 
 /***************** Misc *********/
 #define MAXLINE 1024 /* max string size */
+#define REPLAY_RUNS 8 /* timed runs of a multi-threaded (-j) replay */
+
+/* Latency histograms (-L) are log-linear: each power of two is split into
+   1 << LAT_SUB_BITS equal buckets, so a bucket is within 1/16 of its value */
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
 
 /******************************
  * The key compound data types
@@ -81,8 +94,15 @@ typedef struct range_t {
 typedef struct {
     range_t *list;
     tree_t *lo_tree;
+#ifdef USE_THREADS
+    pthread_mutex_t lock; /* held while the list and tree are updated */
+#endif
 } range_set_t;
 
+#ifdef USE_THREADS
+typedef struct replay replay_t;
+#endif
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -91,8 +111,23 @@ typedef struct {
 typedef struct {
     trace_t *trace;
     range_set_t *ranges;
+#ifdef USE_THREADS
+    replay_t *replay; /* for -j, or NULL */
+#endif
 } speed_t;
 
+/* Latencies of one type of op, in stamp ticks (see clock.h) */
+typedef struct {
+    unsigned long count;
+    unsigned long buckets[LAT_BUCKETS];
+} histogram_t;
+
+/* The share of one thread in a multi-threaded (-j) replay */
+typedef struct {
+    unsigned int ops; /* number of ops the thread ran */
+    double secs;      /* number of secs it needed for them */
+} thread_stats_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set from the trace parameters */
@@ -106,7 +141,31 @@ typedef struct {
     double tput; /* throughput for this trace in Kops/s */
 
     /* defined only for the student malloc package */
-    double util; /* space utilization for this trace (always 0 for libc) */
+    double util;  /* space utilization for this trace (always 0 for libc) */
+    size_t sbrks; /* mem_sbrk calls in the utilization run (0 for libc) */
+
+    /* defined only for a multi-threaded (-j) replay */
+    thread_stats_t *threads; /* one per thread, or NULL */
+
+    /* defined only with -L */
+    histogram_t *latency; /* one per op type (traceopcode_t), or NULL */
+
+    /* defined only with -H */
+    double *counters; /* events per op (see perfctr.h), or NULL */
+
+    /* defined only with -R */
+    double setup_secs;     /* secs for the setup of one timed run */
+    double inclusive_secs; /* secs per run with the setup timed too */
+
+    /* defined only with -S */
+    size_t run_sbrks;        /* mem_sbrk calls in one timed run */
+    mem_syscalls_t syscalls; /* memlib's system calls in one timed run */
+    mem_tlb_stats_t lookups; /* emulated page lookups over all runs */
+
+    /* defined only with -B */
+    mem_page_mode_t ab_pages; /* the other kind of pages the heap got */
+    double ab_secs;           /* secs on those pages, or 0 if not run */
+    double *ab_counters;      /* events per op on those pages, or NULL */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -144,10 +203,33 @@ static debug_mode_t debug_mode = REF_ONLY ? DBG_NONE : DBG_CHEAP;
 static unsigned int verbose = REF_ONLY ? 0 : 1; /* verbosity level */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
+static bool autograder = false; /* if set then called by autograder (-A) */
 static bool tab_mode = false; /* Print output as tab-separated fields */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
+static unsigned int num_threads = 1; /* threads replaying each trace (-j) */
+static bool cross_free = false; /* run frees on another thread (-X) */
+static bool latency_mode = false; /* time each op of the trace (-L) */
+static bool counters_mode = false; /* count hardware events (-H) */
+static bool overhead_mode = false; /* report the timing harness's cost (-R) */
+/* how memlib empties the heap between runs (-r) */
+static mem_reset_mode_t reset_mode = MEM_RESET_COLD;
+static const char *const reset_mode_names[] = {
+    [MEM_RESET_COLD] = "cold",
+    [MEM_RESET_WARM] = "warm",
+    [MEM_RESET_REMAP] = "remap",
+};
+/* the pages the heap is on (-g), and whether to try the other kind (-B) */
+static mem_page_mode_t page_mode = MEM_PAGES_SMALL;
+static bool pages_ab_mode = false;
+static size_t sbrk_granule = 0; /* unit mem_sbrk unlocks the heap in (-G) */
+static bool syscalls_mode = false; /* report memlib's system calls (-S) */
+static const char *const page_mode_names[] = {
+    [MEM_PAGES_SMALL] = "small",
+    [MEM_PAGES_THP] = "thp",
+    [MEM_PAGES_HUGETLB] = "hugetlb",
+};
 
 #ifdef SPARSE_MODE
 size_t queryGlobalSpaceUsage(void);
@@ -191,21 +273,46 @@ static void free_range_set(range_set_t *ranges);
 static void init_random_data(void);
 static bool check_index(const trace_t *trace, unsigned int opnum,
                         unsigned int index);
+static bool check_zeroed(const trace_t *trace, unsigned int opnum,
+                         unsigned int index);
 static void randomize_block(trace_t *trace, unsigned int index);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static bool eval_libc_valid(trace_t *trace);
+static void eval_libc_speed_setup(void *ptr);
 static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctness, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
 static double eval_mm_util(trace_t *trace, size_t tracenum);
+static void eval_mm_speed_setup(void *ptr);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_speed_inclusive(void *ptr);
+static double time_mm_speed(speed_t *speed_params);
+static histogram_t *eval_mm_latency(trace_t *trace);
+static double *eval_mm_counters(speed_t *speed_params);
+static void eval_mm_pages(speed_t *speed_params, stats_t *stats);
+#ifdef USE_THREADS
+static replay_t *replay_new(trace_t *trace, unsigned int threads, bool cross);
+static void replay_free(replay_t *replay);
+static bool eval_mm_valid_mt(trace_t *trace, range_set_t *ranges);
+static double eval_mm_speed_mt(replay_t *replay);
+static thread_stats_t *replay_stats(const replay_t *replay);
+#endif
 static double compute_scaled_score(double value, double min, double max);
 
 /* Various helper routines */
 static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats);
+static void printcounters(size_t n, const stats_t *stats);
+static void printoverhead(size_t n, const stats_t *stats);
+static void printpages(size_t n, const stats_t *stats);
+static void printsyscalls(size_t n, const stats_t *stats);
+static void printlookups(size_t n, const stats_t *stats);
+static unsigned int name_or_usage(const char *arg, const char *const *names,
+                                  unsigned int num_names, const char *prog);
+static size_t size_or_usage(const char *arg, const char *option,
+                            const char *prog);
 static void usage(const char *prog);
 static void malloc_error(const trace_t *trace, unsigned int opnum,
                          const char *fmt, ...)
@@ -287,15 +394,45 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
                 fflush(stderr);
             }
             mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].sbrks = mem_sbrk_calls();
             speed_params->trace = trace;
             speed_params->ranges = ranges;
+#ifdef USE_THREADS
+            speed_params->replay = NULL;
+#endif
             if (verbose > 1) {
                 fputs(", and performance", stderr);
                 fflush(stderr);
             }
-            mm_stats[i].secs =
-                sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+#ifdef USE_THREADS
+            if (num_threads > 1 && !sparse_mode) {
+                speed_params->replay =
+                    replay_new(trace, num_threads, cross_free);
+                mm_stats[i].secs = eval_mm_speed_mt(speed_params->replay);
+                mm_stats[i].threads = replay_stats(speed_params->replay);
+            } else
+#endif
+                mm_stats[i].secs =
+                    sparse_mode ? 1.0 : time_mm_speed(speed_params);
+            mm_stats[i].run_sbrks = mem_sbrk_calls();
+            mm_stats[i].syscalls = mem_syscalls();
+            if (overhead_mode && !sparse_mode && num_threads == 1) {
+                mm_stats[i].setup_secs =
+                    fsec(eval_mm_speed_setup, speed_params);
+                mm_stats[i].inclusive_secs =
+                    fsec(eval_mm_speed_inclusive, speed_params);
+            }
+            if (counters_mode && !sparse_mode)
+                mm_stats[i].counters = eval_mm_counters(speed_params);
+#ifdef USE_THREADS
+            if (speed_params->replay != NULL)
+                replay_free(speed_params->replay);
+#endif
+            if (pages_ab_mode && !sparse_mode && num_threads == 1)
+                eval_mm_pages(speed_params, &mm_stats[i]);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (latency_mode && !sparse_mode)
+                mm_stats[i].latency = eval_mm_latency(trace);
         }
 #endif
         if (verbose > 0) {
@@ -314,6 +451,7 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
         free_range_set(ranges);
 
         /* clean up memory system */
+        mm_stats[i].lookups = mem_tlb_stats();
         mem_deinit();
     }
 }
@@ -333,7 +471,6 @@ int main(int argc, char **argv) {
     sum_stats_t mm_sum_stats;
 
     bool run_libc = false;   /* If set, run libc malloc (set by -l) */
-    bool autograder = false; /* if set then called by autograder (-A) */
     bool checkpoint = false;
 
     const char *tracedir = default_tracedir;
@@ -350,7 +487,8 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:g:j:r:s:t:v:G:hpBCOVAlDHLRSTX")) !=
+           EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -415,6 +553,56 @@ int main(int argc, char **argv) {
             tab_mode = true;
             break;
 
+        case 'j': /* Replay each trace on several threads */
+            num_threads = atoui_or_usage(optarg, "-j", argv[0]);
+            if (num_threads == 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+#ifndef USE_THREADS
+            if (num_threads > 1)
+                app_error("'-j' needs the thread-safe driver, mdriver-mt");
+#endif
+            break;
+
+        case 'r': /* Choose how to reset the heap between runs */
+            reset_mode = (mem_reset_mode_t)name_or_usage(
+                optarg, reset_mode_names, MEM_RESET_REMAP + 1, argv[0]);
+            break;
+
+        case 'g': /* Choose the pages the heap is on */
+            page_mode = (mem_page_mode_t)name_or_usage(
+                optarg, page_mode_names, MEM_PAGES_HUGETLB + 1, argv[0]);
+            break;
+
+        case 'G': /* Unlock the heap this far ahead of the break */
+            sbrk_granule = size_or_usage(optarg, "-G", argv[0]);
+            break;
+
+        case 'S': /* Count memlib's system calls */
+            syscalls_mode = true;
+            break;
+
+        case 'B': /* Time each trace on small and on huge pages */
+            pages_ab_mode = true;
+            break;
+
+        case 'H': /* Count hardware events */
+            counters_mode = true;
+            break;
+
+        case 'R': /* Report how much of the old timing was harness */
+            overhead_mode = true;
+            break;
+
+        case 'L': /* Report the latency of each op */
+            latency_mode = true;
+            break;
+
+        case 'X': /* With -j, free each block on another thread */
+            cross_free = true;
+            break;
+
         case 'h': /* Print usage message */
             usage(argv[0]);
             exit(0);
@@ -449,6 +637,28 @@ int main(int argc, char **argv) {
         init_random_data();
     }
 
+    /* Open the hardware counters, doing without any we can't have */
+    if (counters_mode) {
+        const char *why = NULL;
+        int opened = perfctr_open(&why);
+        if (opened == 0) {
+            fprintf(stderr, "Hardware counters unavailable (%s); ignoring -H\n",
+                    why);
+            counters_mode = false;
+        } else if (opened < PC_NUM_COUNTERS && verbose > 0) {
+            fputs("Hardware counters unavailable:", stderr);
+            for (int e = 0; e < PC_NUM_COUNTERS; e++) {
+                if (!perfctr_available((perfctr_id_t)e))
+                    fprintf(stderr, " %s", perfctr_names[e]);
+            }
+            fputc('\n', stderr);
+        }
+    }
+
+    mem_set_reset_mode(reset_mode);
+    mem_set_page_mode(page_mode);
+    mem_set_sbrk_granule(sbrk_granule);
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         signal(SIGALRM, timeout_handler);
@@ -487,7 +697,9 @@ int main(int argc, char **argv) {
                     fputs(" and performance", stderr);
                     fflush(stderr);
                 }
-                libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
+                libc_stats[i].secs =
+                    fsec_setup(eval_libc_speed, eval_libc_speed_setup, NULL,
+                               &speed_params);
             }
             free_trace(trace);
             if (verbose > 1) {
@@ -524,6 +736,11 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (verbose > 0 && num_threads > 1) {
+        printf("Replaying each trace on %u threads%s\n", num_threads,
+               cross_free ? ", with frees on another thread" : "");
+    }
+
     /*
      * Always run and evaluate the student's mm package
      */
@@ -546,8 +763,23 @@ int main(int argc, char **argv) {
                    ok ? "ok" : "FAIL", tracefiles[num_tracefiles - 1],
                    ok ? "" : "in");
         } else {
-            puts("\nResults for mm malloc:");
+            if (sparse_mode)
+                puts("\nResults for mm malloc:");
+            else
+                printf("\nResults for mm malloc (%s heap resets, %s "
+                       "pages, %zuK sbrk granules):\n",
+                       reset_mode_names[reset_mode],
+                       page_mode_names[mem_page_mode()],
+                       mem_sbrk_granule() / 1024);
             printresults(num_tracefiles, mm_stats, &mm_sum_stats);
+            if (counters_mode)
+                printcounters(num_tracefiles, mm_stats);
+            if (overhead_mode)
+                printoverhead(num_tracefiles, mm_stats);
+            if (pages_ab_mode)
+                printpages(num_tracefiles, mm_stats);
+            if (syscalls_mode)
+                printsyscalls(num_tracefiles, mm_stats);
         }
     }
 
@@ -691,6 +923,8 @@ int main(int argc, char **argv) {
                avg_mm_util * 100);
     }
 
+    if (counters_mode)
+        perfctr_close();
     return 0;
 }
 
@@ -729,44 +963,35 @@ static range_set_t *new_range_set(void) {
     range_set_t *ranges = malloc(sizeof(range_set_t));
     ranges->list = NULL;
     ranges->lo_tree = tree_new();
+#ifdef USE_THREADS
+    pthread_mutex_init(&ranges->lock, NULL);
+#endif
     return ranges;
 }
 
 /*
- * add_range - As directed by request opnum in trace tracenum,
- *     we've just called the student's mm_malloc to allocate a block of
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ * range_lock, range_unlock - Keep other replay threads (-j) out of a range
+ *     set while it is updated
  */
-static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, unsigned int opnum,
-                      unsigned int index) {
-    char *hi = lo + size - 1;
-
-    assert(size > 0);
-
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo)) {
-        malloc_error(trace, opnum,
-                     "Payload address (%p) not aligned to %d bytes", (void *)lo,
-                     ALIGNMENT);
-        return false;
-    }
-
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
-        malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
-                     (void *)lo, (void *)hi, (void *)mem_heap_lo(),
-                     (void *)mem_heap_hi());
-        return false;
-    }
+static void range_lock(range_set_t *ranges) {
+#ifdef USE_THREADS
+    pthread_mutex_lock(&ranges->lock);
+#endif
+}
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
-    if (debug_mode == DBG_NONE)
-        return 1;
+static void range_unlock(range_set_t *ranges) {
+#ifdef USE_THREADS
+    pthread_mutex_unlock(&ranges->lock);
+#endif
+}
 
+/*
+ * insert_range - Check that the payload lo:hi overlaps no other payload
+ *     and, if so, add it to the range list. Called with the set locked.
+ */
+static bool insert_range(range_set_t *ranges, char *lo, char *hi,
+                         const trace_t *trace, unsigned int opnum,
+                         unsigned int index) {
     /* Look in the tree for the predecessor block */
     range_t *prev = tree_find_nearest(ranges->lo_tree, (tkey_t)lo);
     range_t *next = prev ? prev->next : NULL;
@@ -805,13 +1030,58 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     return true;
 }
 
+/*
+ * add_range - As directed by request opnum in trace tracenum,
+ *     we've just called the student's mm_malloc to allocate a block of
+ *     size bytes at addr lo. After checking the block for correctness,
+ *     we create a range struct for this block and add it to the range list.
+ */
+static bool add_range(range_set_t *ranges, char *lo, size_t size,
+                      const trace_t *trace, unsigned int opnum,
+                      unsigned int index) {
+    char *hi = lo + size - 1;
+
+    assert(size > 0);
+
+    /* Payload addresses must be ALIGNMENT-byte aligned */
+    if (!IS_ALIGNED(lo)) {
+        malloc_error(trace, opnum,
+                     "Payload address (%p) not aligned to %d bytes", (void *)lo,
+                     ALIGNMENT);
+        return false;
+    }
+
+    /* The payload must lie within the extent of the heap, or within one of
+       the regions mapped with mem_map */
+    if (!mem_in_heap(lo, size)) {
+        malloc_error(trace, opnum,
+                     "Payload (%p:%p) lies outside heap (%p:%p) and regions",
+                     (void *)lo, (void *)hi, (void *)mem_heap_lo(),
+                     (void *)mem_heap_hi());
+        return false;
+    }
+
+    /* If we can't afford the linear-time loop, we check less thoroughly and
+       just assume the overlap will be caught by writing random bits. */
+    if (debug_mode == DBG_NONE)
+        return 1;
+
+    range_lock(ranges);
+    bool ok = insert_range(ranges, lo, hi, trace, opnum, index);
+    range_unlock(ranges);
+    return ok;
+}
+
 /*
  * remove_range - Free the range record of block whose payload starts at lo
  */
 static void remove_range(range_set_t *ranges, char *lo) {
+    range_lock(ranges);
     range_t *p = (range_t *)tree_remove(ranges->lo_tree, (tkey_t)lo);
-    if (!p)
+    if (!p) {
+        range_unlock(ranges);
         return;
+    }
     range_t *prev = p->prev;
     range_t *next = p->next;
     if (prev)
@@ -820,6 +1090,7 @@ static void remove_range(range_set_t *ranges, char *lo) {
         ranges->list = next;
     if (next)
         next->prev = prev;
+    range_unlock(ranges);
     free(p);
 }
 
@@ -828,6 +1099,9 @@ static void remove_range(range_set_t *ranges, char *lo) {
  */
 static void free_range_set(range_set_t *ranges) {
     tree_free(ranges->lo_tree, free);
+#ifdef USE_THREADS
+    pthread_mutex_destroy(&ranges->lock);
+#endif
     free(ranges);
 }
 
@@ -937,23 +1211,178 @@ static bool check_index(const trace_t *trace, unsigned int opnum,
     return true;
 }
 
+/*
+ * check_zeroed - Check that a block returned by mm_calloc is all zero
+ */
+static bool check_zeroed(const trace_t *trace, unsigned int opnum,
+                         unsigned int index) {
+    const char *block = trace->blocks[index];
+    size_t size = trace->block_sizes[index];
+
+    setUBCheck(false);
+    for (size_t i = 0; i < size; i++) {
+        if (mem_read(&block[i], 1) != 0) {
+            setUBCheck(true);
+            malloc_error(trace, opnum,
+                         "mm_calloc returned block %d (at %p) with a "
+                         "non-zero byte at byte %zu",
+                         index, (const void *)block, i);
+            return false;
+        }
+    }
+    setUBCheck(true);
+    return true;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * valid_op - Run operation i of the trace for eval_mm_valid. Returns false
+ *     if the trace cannot go on; a block whose data was garbled only clears
+ *     *allCheck.
  */
-static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
-    unsigned int i;
-    unsigned int index;
-    size_t size;
+static bool valid_op(trace_t *trace, range_set_t *ranges, unsigned int i,
+                     bool *allCheck) {
+    unsigned int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
     char *newp;
     char *oldp;
     char *p;
+
+    switch (trace->ops[i].type) {
+
+    case ALLOC: /* mm_malloc */
+
+        /* Call the student's malloc */
+        if ((p = mm_malloc(size)) == NULL) {
+            malloc_error(trace, i, "mm_malloc failed");
+            return false;
+        }
+
+        /*
+         * Test the range of the new block for correctness and add it
+         * to the range list if OK. The block must be  be aligned properly,
+         * and must not overlap any currently allocated block.
+         */
+        if (add_range(ranges, p, size, trace, i, index) == 0)
+            return false;
+
+        /* Remember region */
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        /* Set to random data, for debugging. */
+        randomize_block(trace, index);
+        break;
+
+    case CALLOC: /* mm_calloc */
+
+        /* Call the student's calloc */
+        if ((p = mm_calloc(1, size)) == NULL) {
+            malloc_error(trace, i, "mm_calloc failed");
+            return false;
+        }
+
+        /* Same checks as for mm_malloc */
+        if (add_range(ranges, p, size, trace, i, index) == 0)
+            return false;
+
+        /* Remember region */
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        /* The block must be cleared, wherever in the heap it came from */
+        if (!check_zeroed(trace, i, index))
+            return false;
+
+        /* Set to random data, for debugging. */
+        randomize_block(trace, index);
+        break;
+
+    case REALLOC: /* mm_realloc */
+        if (!check_index(trace, i, index)) {
+            *allCheck = false;
+        }
+
+        /* Call the student's realloc */
+        oldp = trace->blocks[index];
+        setUBCheck(false);
+        newp = mm_realloc(oldp, size);
+        setUBCheck(true);
+        if ((newp == NULL) && (size != 0)) {
+            malloc_error(trace, i, "mm_realloc failed");
+            return false;
+        }
+        if ((newp != NULL) && (size == 0)) {
+            malloc_error(trace, i,
+                         "mm_realloc with size 0 returned "
+                         "non-NULL");
+            return false;
+        }
+
+        /* Remove the old region from the range list */
+        remove_range(ranges, oldp);
+
+        /* Check new block for correctness and add it to range list */
+        if (size > 0) {
+            if (add_range(ranges, newp, size, trace, i, index) == 0)
+                return false;
+        }
+
+        /* Move the region from where it was.
+         * Check up to min(size, oldsize) for correct copying. */
+        trace->blocks[index] = newp;
+        if (size < trace->block_sizes[index]) {
+            trace->block_sizes[index] = size;
+        }
+        // NOTE: Might help to pass old size here to check bytes at each end
+        // of allocation
+
+        if (!check_index(trace, i, index)) {
+            *allCheck = false;
+        }
+        trace->block_sizes[index] = size;
+
+        /* Set to random data, for debugging. */
+        randomize_block(trace, index);
+        break;
+
+    case FREE: /* mm_free */
+        if (!check_index(trace, i, index)) {
+            *allCheck = false;
+        }
+
+        /* Remove region from list and call student's free function */
+        if (index == (unsigned int)-1) {
+            p = 0;
+        } else {
+            p = trace->blocks[index];
+            remove_range(ranges, p);
+        }
+        mm_free(p);
+        break;
+
+    default:
+        app_error("Invalid request type in eval_mm_valid");
+    }
+    return true;
+}
+
+/*
+ * eval_mm_valid - Check the mm malloc package for correctness
+ */
+static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
+    unsigned int i;
     bool allCheck = true;
 
+#ifdef USE_THREADS
+    if (num_threads > 1)
+        return eval_mm_valid_mt(trace, ranges);
+#endif
+
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
     reinit_trace(trace);
@@ -966,9 +1395,6 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
 
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++) {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
-
         if (debug_mode == DBG_EXPENSIVE) {
             range_t *r;
 
@@ -988,98 +1414,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             }
         }
 
-        switch (trace->ops[i].type) {
-
-        case ALLOC: /* mm_malloc */
-
-            /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
-                malloc_error(trace, i, "mm_malloc failed");
-                return false;
-            }
-
-            /*
-             * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
-             * and must not overlap any currently allocated block.
-             */
-            if (add_range(ranges, p, size, trace, i, index) == 0)
-                return false;
-
-            /* Remember region */
-            trace->blocks[index] = p;
-            trace->block_sizes[index] = size;
-
-            /* Set to random data, for debugging. */
-            randomize_block(trace, index);
-            break;
-
-        case REALLOC: /* mm_realloc */
-            if (!check_index(trace, i, index)) {
-                allCheck = false;
-            }
-
-            /* Call the student's realloc */
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            newp = mm_realloc(oldp, size);
-            setUBCheck(true);
-            if ((newp == NULL) && (size != 0)) {
-                malloc_error(trace, i, "mm_realloc failed");
-                return false;
-            }
-            if ((newp != NULL) && (size == 0)) {
-                malloc_error(trace, i,
-                             "mm_realloc with size 0 returned "
-                             "non-NULL");
-                return false;
-            }
-
-            /* Remove the old region from the range list */
-            remove_range(ranges, oldp);
-
-            /* Check new block for correctness and add it to range list */
-            if (size > 0) {
-                if (add_range(ranges, newp, size, trace, i, index) == 0)
-                    return false;
-            }
-
-            /* Move the region from where it was.
-             * Check up to min(size, oldsize) for correct copying. */
-            trace->blocks[index] = newp;
-            if (size < trace->block_sizes[index]) {
-                trace->block_sizes[index] = size;
-            }
-            // NOTE: Might help to pass old size here to check bytes at each end
-            // of allocation
-
-            if (!check_index(trace, i, index)) {
-                allCheck = false;
-            }
-            trace->block_sizes[index] = size;
-
-            /* Set to random data, for debugging. */
-            randomize_block(trace, index);
-            break;
-
-        case FREE: /* mm_free */
-            if (!check_index(trace, i, index)) {
-                allCheck = false;
-            }
-
-            /* Remove region from list and call student's free function */
-            if (index == (unsigned int)-1) {
-                p = 0;
-            } else {
-                p = trace->blocks[index];
-                remove_range(ranges, p);
-            }
-            mm_free(p);
-            break;
-
-        default:
-            app_error("Invalid request type in eval_mm_valid");
-        }
+        if (!valid_op(trace, ranges, i, &allCheck))
+            return false;
     }
     /* As far as we know, this is a valid malloc package */
     return allCheck;
@@ -1090,10 +1426,12 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap plus any regions mapped with mem_map() while
+ *   running the student's malloc package on the trace (mem_peaksize()).
+ *   The peak is used rather than the final size of the heap, since
+ *   mem_sbrk() may be given a negative increment to shrink the heap
+ *   (as trim_heap does), leaving the final size below the footprint the
+ *   package actually needed.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1132,6 +1470,22 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
             total_size += size;
             break;
 
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = mm_calloc(1, size)) == NULL) {
+                app_error("trace %zd: mm_calloc failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1177,7 +1531,63 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
             (total_size > max_total_size) ? total_size : max_total_size;
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peaksize());
+}
+
+/*
+ * speed_op - Run operation i of the trace for eval_mm_speed
+ */
+static void speed_op(trace_t *trace, unsigned int i) {
+    unsigned int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    char *p, *newp, *oldp, *block;
+
+    switch (trace->ops[i].type) {
+
+    case ALLOC: /* mm_malloc */
+        if ((p = mm_malloc(size)) == NULL)
+            app_error("mm_malloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+    case CALLOC: /* mm_calloc */
+        if ((p = mm_calloc(1, size)) == NULL)
+            app_error("mm_calloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+    case REALLOC: /* mm_realloc */
+        oldp = trace->blocks[index];
+        setUBCheck(false);
+        if ((newp = mm_realloc(oldp, size)) == NULL && size != 0)
+            app_error("mm_realloc error in eval_mm_speed");
+        setUBCheck(true);
+        trace->blocks[index] = newp;
+        break;
+
+    case FREE: /* mm_free */
+        if (index == (unsigned int)-1) {
+            block = 0;
+        } else {
+            block = trace->blocks[index];
+        }
+        mm_free(block);
+        break;
+
+    default:
+        app_error("Nonexistent request type in eval_mm_speed");
+    }
+}
+
+/*
+ * eval_mm_speed_setup - Get the trace and the heap ready for
+ *    eval_mm_speed. fsec_setup() runs this outside the timed region, so
+ *    the driver's memsets and the remapping of the heap are not charged
+ *    to the mm package.
+ */
+static void eval_mm_speed_setup(void *ptr) {
+    reinit_trace(((speed_t *)ptr)->trace);
+    mem_reset_brk();
 }
 
 /*
@@ -1185,54 +1595,442 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr) {
-    unsigned int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
+    unsigned int i;
     trace_t *trace = ((speed_t *)ptr)->trace;
-    reinit_trace(trace);
 
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
+    /* Initialize the mm package */
     if (!mm_init())
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type) {
+        speed_op(trace, i);
+}
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+/*
+ * eval_mm_speed_inclusive - eval_mm_speed with its setup inside the timed
+ *    region, the way it used to be measured (for -R)
+ */
+static void eval_mm_speed_inclusive(void *ptr) {
+    eval_mm_speed_setup(ptr);
+    eval_mm_speed(ptr);
+}
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            setUBCheck(true);
-            trace->blocks[index] = newp;
+/*
+ * time_mm_speed - Time eval_mm_speed for the throughput score. The
+ *    reference throughputs (throughputs.txt, mdriver-ref) were measured
+ *    with the setup inside the timed region, so graded runs (-A) still
+ *    time it; other runs leave it out.
+ */
+static double time_mm_speed(speed_t *speed_params) {
+    if (autograder)
+        return fsec(eval_mm_speed_inclusive, speed_params);
+    return fsec_setup(eval_mm_speed, eval_mm_speed_setup, NULL, speed_params);
+}
+
+/*****************************************************************
+ * Latency histograms (-L). One more replay of the trace, with each
+ * mm_malloc, mm_free, mm_realloc and mm_calloc call timed by the stamp
+ * counter and counted in the histogram of its op type.
+ ****************************************************************/
+
+/*
+ * hist_index - The bucket for a latency of v ticks. Values below
+ *     2 << LAT_SUB_BITS have a bucket each; above that, bucket widths
+ *     double with each power of two.
+ */
+static size_t hist_index(uint64_t v) {
+    unsigned int msb = v == 0 ? 0 : 63u - (unsigned int)__builtin_clzll(v);
+    unsigned int shift = msb <= LAT_SUB_BITS ? 0 : msb - LAT_SUB_BITS;
+    return ((size_t)shift << LAT_SUB_BITS) + (size_t)(v >> shift);
+}
+
+/*
+ * hist_bucket_max - The largest latency, in ticks, counted in bucket b
+ */
+static uint64_t hist_bucket_max(size_t b) {
+    size_t sub = (size_t)1 << LAT_SUB_BITS;
+    unsigned int shift = b < 2 * sub ? 0 : (unsigned int)(b / sub - 1);
+    uint64_t lo = (uint64_t)(b - ((size_t)shift << LAT_SUB_BITS)) << shift;
+    return lo + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * hist_percentile - The latency, in ns, that a fraction p of the ops in
+ *     the histogram do not exceed (to within a bucket)
+ */
+static double hist_percentile(const histogram_t *h, double p) {
+    double rank = p * (double)h->count;
+    unsigned long seen = 0;
+    size_t b;
+
+    if (h->count == 0)
+        return 0.0;
+    for (b = 0; b < LAT_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen > 0 && (double)seen >= rank)
             break;
+    }
+    return (double)hist_bucket_max(b) / stamp_ticks_per_ns();
+}
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index == (unsigned int)-1) {
-                block = 0;
-            } else {
-                block = trace->blocks[index];
-            }
-            mm_free(block);
+/*
+ * eval_mm_latency - Replay the trace once more, timing every call into
+ *    the mm package. Returns one histogram per op type. The replay is
+ *    single-threaded, and kept apart from eval_mm_speed so that reading
+ *    the stamps doesn't show up in the throughput.
+ */
+static histogram_t *eval_mm_latency(trace_t *trace) {
+    histogram_t *hists = calloc(CALLOC + 1, sizeof(histogram_t));
+    if (hists == NULL)
+        unix_error("calloc in eval_mm_latency failed");
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+    stamp_ticks_per_ns(); /* calibrate before, not during, the replay */
+
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        uint64_t start = read_stamp();
+        speed_op(trace, i);
+        uint64_t ticks = read_stamp() - start;
+
+        histogram_t *h = &hists[trace->ops[i].type];
+        h->count++;
+        h->buckets[hist_index(ticks)]++;
+    }
+    return hists;
+}
+
+/*
+ * eval_mm_counters - Count hardware events over one more eval_mm_speed
+ *    (with -j, eval_mm_speed_mt) and return them per op of the trace.
+ *    Events without a counter come out negative.
+ */
+static double *eval_mm_counters(speed_t *speed_params) {
+    double *counts = malloc(PC_NUM_COUNTERS * sizeof(*counts));
+    double ops = speed_params->trace->num_ops;
+
+    if (counts == NULL)
+        unix_error("malloc in eval_mm_counters failed");
+    eval_mm_speed_setup(speed_params);
+    perfctr_start();
+#ifdef USE_THREADS
+    if (speed_params->replay != NULL) {
+        eval_mm_speed_mt(speed_params->replay);
+        ops *= REPLAY_RUNS;
+    } else
+#endif
+        eval_mm_speed(speed_params);
+    perfctr_stop(counts);
+
+    for (int e = 0; e < PC_NUM_COUNTERS; e++) {
+        if (counts[e] >= 0)
+            counts[e] /= ops;
+    }
+    return counts;
+}
+
+/*
+ * eval_mm_pages - Time the trace again with the heap on the other kind of
+ *    pages: huge ones if it is on small pages, else small ones (for -B)
+ */
+static void eval_mm_pages(speed_t *speed_params, stats_t *stats) {
+    mem_deinit();
+    mem_set_page_mode(page_mode == MEM_PAGES_SMALL ? MEM_PAGES_THP
+                                                   : MEM_PAGES_SMALL);
+    mem_init(false);
+    stats->ab_pages = mem_page_mode();
+    stats->ab_secs = fsec_setup(eval_mm_speed, eval_mm_speed_setup, NULL,
+                                speed_params);
+    if (counters_mode)
+        stats->ab_counters = eval_mm_counters(speed_params);
+
+    /* Back to the heap the rest of the run uses */
+    mem_deinit();
+    mem_set_page_mode(page_mode);
+    mem_init(false);
+}
+
+#ifdef USE_THREADS
+/*****************************************************************
+ * Multi-threaded replay (-j). The block ids of a trace are dealt out
+ * to the threads round-robin, and each thread runs the ops on its ids
+ * in trace order. With -X, frees run on the thread after the one that
+ * owns the id, so every free is a cross-thread free.
+ *
+ * An op waits until all earlier ops on its id are done. Each wait is
+ * for an op earlier in the trace, so the earliest op not yet done can
+ * always run, and the replay cannot deadlock.
+ ****************************************************************/
+
+/* One replay thread */
+typedef struct {
+    replay_t *replay;
+    pthread_t thread;
+    unsigned int *ops;     /* its ops, as indices into trace->ops */
+    unsigned int num_ops;  /* number of its ops */
+    bool valid;            /* did its ops run correctly? */
+    bool intact;           /* did its blocks keep their data? */
+    double start, end;     /* when it started and finished the last run */
+    double best_secs;      /* shortest time of any run */
+} worker_t;
+
+struct replay {
+    trace_t *trace;
+    range_set_t *ranges; /* set to check the ops, NULL to time them */
+    unsigned int *seq;   /* for each op: number of earlier ops on its id */
+    unsigned int *done;  /* for each id: number of its ops done */
+    bool failed;         /* set when an op fails, to stop the others */
+    unsigned int threads;
+    worker_t *workers;
+    pthread_barrier_t start;
+};
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/*
+ * op_thread - The thread that runs operation i of the trace
+ */
+static unsigned int op_thread(const trace_t *trace, unsigned int i,
+                              unsigned int threads, bool cross) {
+    unsigned int index = trace->ops[i].index;
+    if (index == (unsigned int)-1)
+        return i % threads; /* free(NULL) waits for nothing */
+
+    unsigned int t = index % threads;
+    if (cross && trace->ops[i].type == FREE)
+        t = (t + 1) % threads;
+    return t;
+}
+
+/*
+ * replay_new - Deal the ops of a trace out to threads
+ */
+static replay_t *replay_new(trace_t *trace, unsigned int threads,
+                            bool cross) {
+    replay_t *replay = calloc(1, sizeof(replay_t));
+    if (replay == NULL)
+        unix_error("calloc in replay_new failed");
+    replay->trace = trace;
+    replay->threads = threads;
+    replay->seq = malloc(trace->num_ops * sizeof(*replay->seq));
+    replay->done = calloc(trace->num_ids, sizeof(*replay->done));
+    replay->workers = calloc(threads, sizeof(worker_t));
+    if (replay->seq == NULL || replay->done == NULL ||
+        replay->workers == NULL)
+        unix_error("malloc in replay_new failed");
+
+    /* Number the ops on each id and count the ops of each thread */
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        unsigned int index = trace->ops[i].index;
+        replay->seq[i] = index == (unsigned int)-1 ? 0 : replay->done[index]++;
+        replay->workers[op_thread(trace, i, threads, cross)].num_ops++;
+    }
+
+    for (unsigned int t = 0; t < threads; t++) {
+        worker_t *w = &replay->workers[t];
+        w->replay = replay;
+        w->ops = malloc((w->num_ops + 1) * sizeof(*w->ops));
+        if (w->ops == NULL)
+            unix_error("malloc in replay_new failed");
+        w->num_ops = 0;
+    }
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        worker_t *w = &replay->workers[op_thread(trace, i, threads, cross)];
+        w->ops[w->num_ops++] = i;
+    }
+    return replay;
+}
+
+/*
+ * replay_free - Free a replay and its threads' op lists
+ */
+static void replay_free(replay_t *replay) {
+    for (unsigned int t = 0; t < replay->threads; t++)
+        free(replay->workers[t].ops);
+    free(replay->workers);
+    free(replay->seq);
+    free(replay->done);
+    free(replay);
+}
+
+/*
+ * replay_wait - Wait until all earlier ops on the id of op i are done.
+ *     Returns false if another thread failed in the meantime.
+ */
+static bool replay_wait(replay_t *replay, unsigned int i) {
+    unsigned int index = replay->trace->ops[i].index;
+    if (index == (unsigned int)-1)
+        return true;
+    while (__atomic_load_n(&replay->done[index], __ATOMIC_ACQUIRE) !=
+           replay->seq[i]) {
+        if (__atomic_load_n(&replay->failed, __ATOMIC_RELAXED))
+            return false;
+        sched_yield();
+    }
+    return true;
+}
+
+/*
+ * replay_worker - Run the ops of one thread
+ */
+static void *replay_worker(void *arg) {
+    worker_t *w = arg;
+    replay_t *replay = w->replay;
+    trace_t *trace = replay->trace;
+
+    w->valid = true;
+    w->intact = true;
+    pthread_barrier_wait(&replay->start);
+    w->start = now_secs();
+
+    for (unsigned int k = 0; k < w->num_ops; k++) {
+        unsigned int i = w->ops[k];
+        unsigned int index = trace->ops[i].index;
+
+        if (!replay_wait(replay, i)) {
+            w->valid = false;
             break;
+        }
+        if (replay->ranges == NULL) {
+            speed_op(trace, i);
+        } else {
+            /* The other threads' blocks may be in flux, so unlike
+               eval_mm_valid we leave their data alone */
+            if (debug_mode == DBG_EXPENSIVE && !mm_checkheap(0)) {
+                malloc_error(trace, i, "mm_checkheap returned false");
+                w->valid = false;
+            } else if (!valid_op(trace, replay->ranges, i, &w->intact)) {
+                w->valid = false;
+            }
+            if (!w->valid) {
+                __atomic_store_n(&replay->failed, true, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        if (index != (unsigned int)-1)
+            __atomic_store_n(&replay->done[index], replay->seq[i] + 1,
+                             __ATOMIC_RELEASE);
+    }
 
-        default:
-            app_error("Nonexistent request type in eval_mm_speed");
+    w->end = now_secs();
+    return NULL;
+}
+
+/*
+ * replay_run - Run a replay on the current heap, checking the ops against
+ *     ranges, or only timing them if ranges is NULL. Returns false if an op
+ *     failed or garbled a block.
+ */
+static bool replay_run(replay_t *replay, range_set_t *ranges,
+                       double *secs) {
+    unsigned int t;
+    int err;
+
+    replay->ranges = ranges;
+    replay->failed = false;
+    memset(replay->done, 0, replay->trace->num_ids * sizeof(*replay->done));
+    pthread_barrier_init(&replay->start, NULL, replay->threads);
+
+    for (t = 0; t < replay->threads; t++) {
+        worker_t *w = &replay->workers[t];
+        if ((err = pthread_create(&w->thread, NULL, replay_worker, w)) != 0)
+            app_error("pthread_create in replay_run failed: %s",
+                      strerror(err));
+    }
+    bool valid = true;
+    double start = DBL_MAX, end = 0.0;
+    for (t = 0; t < replay->threads; t++) {
+        worker_t *w = &replay->workers[t];
+        pthread_join(w->thread, NULL);
+        valid = valid && w->valid && w->intact;
+        start = w->start < start ? w->start : start;
+        end = w->end > end ? w->end : end;
+    }
+    *secs = end - start;
+
+    pthread_barrier_destroy(&replay->start);
+    return valid;
+}
+
+/*
+ * eval_mm_valid_mt - Check the mm malloc package for correctness, replaying
+ *     the trace on num_threads threads
+ */
+static bool eval_mm_valid_mt(trace_t *trace, range_set_t *ranges) {
+    /* Reset the heap and free any records in the range list */
+    mem_reset_brk();
+    reinit_trace(trace);
+
+    /* Call the mm package's init function */
+    if (!mm_init()) {
+        malloc_error(trace, 0, "mm_init failed");
+        return false;
+    }
+
+    replay_t *replay = replay_new(trace, num_threads, cross_free);
+    double secs;
+    bool valid = replay_run(replay, ranges, &secs);
+    replay_free(replay);
+
+    /* With the threads gone, the heap must be consistent again */
+    if (valid && !mm_checkheap(0)) {
+        malloc_error(trace, trace->num_ops - 1, "mm_checkheap returned false");
+        return false;
+    }
+    return valid;
+}
+
+/*
+ * eval_mm_speed_mt - Measure the running time of the mm malloc package on
+ *    a multi-threaded replay. fsec() only counts the CPU time of the thread
+ *    that calls it, so instead we take the best wall-clock time of
+ *    REPLAY_RUNS runs, from the first thread starting to the last one
+ *    finishing. Each thread also keeps its own best time.
+ */
+static double eval_mm_speed_mt(replay_t *replay) {
+    double best = DBL_MAX;
+
+    for (unsigned int run = 0; run < REPLAY_RUNS; run++) {
+        reinit_trace(replay->trace);
+
+        /* Reset the heap and initialize the mm package */
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_speed_mt");
+
+        double secs;
+        replay_run(replay, NULL, &secs);
+        best = secs < best ? secs : best;
+        for (unsigned int t = 0; t < replay->threads; t++) {
+            worker_t *w = &replay->workers[t];
+            if (run == 0 || w->end - w->start < w->best_secs)
+                w->best_secs = w->end - w->start;
         }
+    }
+    return best;
+}
+
+/*
+ * replay_stats - Record the per-thread results of a timed replay
+ */
+static thread_stats_t *replay_stats(const replay_t *replay) {
+    thread_stats_t *stats = calloc(replay->threads, sizeof(thread_stats_t));
+    if (stats == NULL)
+        unix_error("calloc in replay_stats failed");
+    for (unsigned int t = 0; t < replay->threads; t++) {
+        stats[t].ops = replay->workers[t].num_ops;
+        stats[t].secs = replay->workers[t].best_secs;
+    }
+    return stats;
 }
+#endif /* USE_THREADS */
 
 /*
  * eval_libc_valid - We run this function to make sure that the
@@ -1258,6 +2056,14 @@ static bool eval_libc_valid(trace_t *trace) {
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+                malloc_error(trace, i, "libc calloc failed: %s",
+                             strerror(errno));
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1284,6 +2090,14 @@ static bool eval_libc_valid(trace_t *trace) {
     return true;
 }
 
+/*
+ * eval_libc_speed_setup - Get the trace ready for eval_libc_speed, outside
+ *    the timed region
+ */
+static void eval_libc_speed_setup(void *ptr) {
+    reinit_trace(((speed_t *)ptr)->trace);
+}
+
 /*
  * eval_libc_speed - This is the function that is used by fcyc() to
  *    measure the running time of the libc malloc package on the set
@@ -1296,8 +2110,6 @@ static void eval_libc_speed(void *ptr) {
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    reinit_trace(trace);
-
     for (i = 0; i < trace->num_ops; i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
@@ -1308,6 +2120,14 @@ static void eval_libc_speed(void *ptr) {
             trace->blocks[index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = calloc(1, size)) == NULL)
+                unix_error("calloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1335,6 +2155,36 @@ static void eval_libc_speed(void *ptr) {
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * print_latency - prints the p50, p99 and p999 latencies of the ops of
+ * types first to last, as columns of the results table
+ */
+static void print_latency(const histogram_t *hists, int first, int last) {
+    static const double pcts[] = {0.5, 0.99, 0.999};
+    histogram_t all;
+
+    if (hists == NULL) {
+        if (tab_mode)
+            printf("\t\t\t");
+        else
+            printf("%6s %6s %6s ", "--", "--", "--");
+        return;
+    }
+    all = hists[first];
+    for (int op = first + 1; op <= last; op++) {
+        all.count += hists[op].count;
+        for (size_t b = 0; b < LAT_BUCKETS; b++)
+            all.buckets[b] += hists[op].buckets[b];
+    }
+    for (size_t k = 0; k < sizeof(pcts) / sizeof(pcts[0]); k++) {
+        double ns = hist_percentile(&all, pcts[k]);
+        if (tab_mode)
+            printf("%.0f\t", ns);
+        else
+            printf("%6.0f ", ns);
+    }
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and
  * returns a summary of the stats to the caller.
@@ -1347,6 +2197,7 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
     double sumops = 0;
     double sumtput = 0;
     double sumutil = 0;
+    size_t sumsbrks = 0;
     int sum_perf_weight = 0;
     int sum_util_weight = 0;
 
@@ -1355,10 +2206,16 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
 
     /* Print the individual results for each trace */
     if (tab_mode) {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tsbrks\tops\tmsecs\tKops/s\t%s"
+               "trace\n",
+               latency_mode ? "p50ns\tp99ns\tp999ns\t" : "");
+    } else if (latency_mode) {
+        printf("  %5s  %6s %6s %7s%8s%8s%7s%7s%7s  %s\n", "valid", "util",
+               "sbrks", "ops", "msecs", "Kops/s", "p50ns", "p99ns", "p999ns",
+               "trace");
     } else {
-        printf("  %5s  %6s %7s%8s%8s  %s\n", "valid", "util", "ops", "msecs",
-               "Kops/s", "trace");
+        printf("  %5s  %6s %6s %7s%8s%8s  %s\n", "valid", "util", "sbrks",
+               "ops", "msecs", "Kops/s", "trace");
     }
     for (i = 0; i < n; i++) {
         if (stats[i].valid) {
@@ -1405,6 +2262,15 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
                     printf(" %8s", "--");
             }
 
+            /* Heap extensions */
+            if (tab_mode) {
+                printf("%zu\t", stats[i].sbrks);
+            } else if (stats[i].sbrks > 0) {
+                printf("%7zu", stats[i].sbrks);
+            } else {
+                printf("%7s", "--");
+            }
+
             /* Ops + Time */
             double msecs = sparse_mode ? 0.0 : stats[i].secs * 1000.0;
             double kops = sparse_mode ? 0.0 : stats[i].tput;
@@ -1419,8 +2285,43 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Latency percentiles, over all ops */
+            if (latency_mode) {
+                print_latency(stats[i].latency, ALLOC, CALLOC);
+            }
+
             printf("%s\n", stats[i].filename);
 
+            /* Latency percentiles of each op type */
+            for (int op = ALLOC; stats[i].latency && op <= CALLOC; op++) {
+                static const char *const op_names[] = {"malloc", "free",
+                                                       "realloc", "calloc"};
+                if (stats[i].latency[op].count == 0)
+                    continue;
+                if (tab_mode)
+                    printf("%s\t\t\t\t\t%lu\t\t\t", op_names[op],
+                           stats[i].latency[op].count);
+                else
+                    printf("%13s %-8s%8lu%17s ", "", op_names[op],
+                           stats[i].latency[op].count, "");
+                print_latency(stats[i].latency, op, op);
+                printf("%s\n", tab_mode ? stats[i].filename : "");
+            }
+
+            /* Per-thread throughput of a -j replay */
+            for (unsigned int t = 0; stats[i].threads && t < num_threads;
+                 t++) {
+                thread_stats_t *ts = &stats[i].threads[t];
+                double tkops = ts->ops / (ts->secs * 1000.0);
+                if (tab_mode)
+                    printf("thread%u\t\t\t\t\t%u\t%.3f\t%.0f\t%s\n", t,
+                           ts->ops, ts->secs * 1000.0, tkops,
+                           stats[i].filename);
+                else
+                    printf("%13s %-8u%8u%10.3f%7.0f\n", "thread", t, ts->ops,
+                           ts->secs * 1000.0, tkops);
+            }
+
             if (stats[i].weight == WALL || stats[i].weight == WPERF) {
                 sum_perf_weight += 1;
                 sumsecs += stats[i].secs;
@@ -1430,14 +2331,15 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
             if (stats[i].weight == WALL || stats[i].weight == WUTIL) {
                 sum_util_weight += 1;
                 sumutil += stats[i].util;
+                sumsbrks += stats[i].sbrks;
             }
         } else {
             if (tab_mode) {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t\t%s\n", stats[i].filename);
             } else {
-                printf("%2s%4s%7s%10s%7s%10s %s\n",
+                printf("%2s%4s%7s%7s%10s%7s%10s %s\n",
                        stats[i].weight != 0 ? "*" : "", "no", "-", "-", "-",
-                       "-", stats[i].filename);
+                       "-", "-", stats[i].filename);
             }
         }
     }
@@ -1451,7 +2353,7 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
         sumstats->tput = 0;
     } else if (errors > 0) {
         if (!tab_mode) {
-            printf("     %8s%10s%7s\n", "-", "-", "-");
+            printf("     %8s%7s%10s%7s\n", "-", "-", "-", "-");
         }
         sumstats->util = 0;
         sumstats->ops = 0;
@@ -1468,13 +2370,15 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
         if (sparse_mode)
             sumsecs = 0;
         if (tab_mode) {
-            // "valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace"
-            printf("Sum\t%d\t%d\t%.1f\t%.0f\t%.2f\n", sum_perf_weight,
-                   sum_util_weight, sumutil * 100.0, sumops, sumsecs * 1000.0);
-            printf("Avg\t\t\t%.1f\t\t\t\n", util * 100.0);
+            // "valid\tthru?\tutil?\tutil\tsbrks\tops\tmsecs\tKops\ttrace"
+            printf("Sum\t%d\t%d\t%.1f\t%zu\t%.0f\t%.2f\n", sum_perf_weight,
+                   sum_util_weight, sumutil * 100.0, sumsbrks, sumops,
+                   sumsecs * 1000.0);
+            printf("Avg\t\t\t%.1f\t\t\t\t\n", util * 100.0);
         } else {
-            printf("%2d %2d  %7.1f%%%8.0f%10.3f\n", sum_util_weight,
-                   sum_perf_weight, util * 100.0, sumops, sumsecs * 1000.0);
+            printf("%2d %2d  %7.1f%%%7zu%8.0f%10.3f\n", sum_util_weight,
+                   sum_perf_weight, util * 100.0, sumsbrks, sumops,
+                   sumsecs * 1000.0);
         }
 
         sumstats->util = util;
@@ -1484,6 +2388,184 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
     }
 }
 
+/*
+ * printcounters - prints the hardware events per op of each trace
+ */
+static void printcounters(size_t n, const stats_t *stats) {
+    puts("\nHardware events per op:");
+    for (int e = 0; e < PC_NUM_COUNTERS; e++) {
+        if (tab_mode)
+            printf("%s\t", perfctr_names[e]);
+        else
+            printf("%10s", perfctr_names[e]);
+    }
+    printf("%strace\n", tab_mode ? "" : "  ");
+
+    for (size_t i = 0; i < n; i++) {
+        for (int e = 0; e < PC_NUM_COUNTERS; e++) {
+            double count = stats[i].counters ? stats[i].counters[e] : -1.0;
+            if (tab_mode && count < 0)
+                printf("\t");
+            else if (tab_mode)
+                printf("%.3f\t", count);
+            else if (count < 0)
+                printf("%10s", "--");
+            else
+                printf("%10.3f", count);
+        }
+        printf("%s%s\n", tab_mode ? "" : "  ", stats[i].filename);
+    }
+}
+
+/*
+ * printoverhead - prints, for each trace, how much of a timed run would
+ * be harness overhead if the heap reset and trace reinit were timed too
+ */
+static void printoverhead(size_t n, const stats_t *stats) {
+    puts("\nHarness overhead (heap reset and trace reinit, now untimed):");
+    if (tab_mode)
+        printf("msecs\tw/setup\tsetup\toverhead\ttrace\n");
+    else
+        printf("%10s%10s%10s%10s  %s\n", "msecs", "w/setup", "setup",
+               "overhead", "trace");
+
+    for (size_t i = 0; i < n; i++) {
+        double incl = stats[i].inclusive_secs;
+        if (incl <= 0) {
+            if (tab_mode)
+                printf("\t\t\t\t%s\n", stats[i].filename);
+            else
+                printf("%10s%10s%10s%10s  %s\n", "--", "--", "--", "--",
+                       stats[i].filename);
+            continue;
+        }
+        double pct = (incl - stats[i].secs) / incl * 100.0;
+        if (tab_mode)
+            printf("%.3f\t%.3f\t%.3f\t%.1f\t%s\n", stats[i].secs * 1000.0,
+                   incl * 1000.0, stats[i].setup_secs * 1000.0, pct,
+                   stats[i].filename);
+        else
+            printf("%10.3f%10.3f%10.3f%9.1f%%  %s\n", stats[i].secs * 1000.0,
+                   incl * 1000.0, stats[i].setup_secs * 1000.0, pct,
+                   stats[i].filename);
+    }
+}
+
+/*
+ * printpages - prints, for each trace, the throughput (and dTLB misses per
+ * op, with -H) on the heap's pages and on the other kind, for -B
+ */
+static void printpages(size_t n, const stats_t *stats) {
+    const char *a = page_mode_names[mem_page_mode()];
+    const char *b = NULL;
+    for (size_t i = 0; i < n && b == NULL; i++) {
+        if (stats[i].ab_secs > 0)
+            b = page_mode_names[stats[i].ab_pages];
+    }
+    if (b == NULL)
+        return;
+
+    printf("\nPage size comparison, Kops/sec and dTLB misses per op (%s "
+           "vs %s):\n",
+           a, b);
+    if (tab_mode)
+        printf("%s\t%s\tspeedup\t%s\t%s\ttrace\n", a, b, a, b);
+    else
+        printf("%10s%10s%9s%10s%10s  %s\n", a, b, "speedup", a, b, "trace");
+
+    for (size_t i = 0; i < n; i++) {
+        if (stats[i].ab_secs <= 0) {
+            if (tab_mode)
+                printf("\t\t\t\t\t%s\n", stats[i].filename);
+            else
+                printf("%10s%10s%9s%10s%10s  %s\n", "--", "--", "--", "--",
+                       "--", stats[i].filename);
+            continue;
+        }
+        double kops_a = stats[i].ops / (stats[i].secs * 1000.0);
+        double kops_b = stats[i].ops / (stats[i].ab_secs * 1000.0);
+        double tlb_a = stats[i].counters != NULL
+                           ? stats[i].counters[PC_DTLB_MISSES]
+                           : -1.0;
+        double tlb_b = stats[i].ab_counters != NULL
+                           ? stats[i].ab_counters[PC_DTLB_MISSES]
+                           : -1.0;
+        if (tab_mode)
+            printf("%.0f\t%.0f\t%.3f\t", kops_a, kops_b, kops_b / kops_a);
+        else
+            printf("%10.0f%10.0f%8.2fx", kops_a, kops_b, kops_b / kops_a);
+        double tlbs[2] = {tlb_a, tlb_b};
+        for (int t = 0; t < 2; t++) {
+            if (tab_mode && tlbs[t] < 0)
+                printf("\t");
+            else if (tab_mode)
+                printf("%.4f\t", tlbs[t]);
+            else if (tlbs[t] < 0)
+                printf("%10s", "--");
+            else
+                printf("%10.4f", tlbs[t]);
+        }
+        printf("%s%s\n", tab_mode ? "" : "  ", stats[i].filename);
+    }
+}
+
+/*
+ * printlookups - prints, for each trace, how often sparse emulation found
+ * a page among the ones used last, rather than in the page table
+ */
+static void printlookups(size_t n, const stats_t *stats) {
+    puts("\nEmulated page lookups:");
+    if (tab_mode)
+        printf("cached\tsearched\thit%%\ttrace\n");
+    else
+        printf("%12s%12s%8s  %s\n", "cached", "searched", "hit%", "trace");
+
+    for (size_t i = 0; i < n; i++) {
+        const mem_tlb_stats_t *ls = &stats[i].lookups;
+        size_t total = ls->hits + ls->misses;
+        double pct = total > 0 ? 100.0 * (double)ls->hits / (double)total
+                               : 0.0;
+        if (tab_mode)
+            printf("%zu\t%zu\t%.1f\t%s\n", ls->hits, ls->misses, pct,
+                   stats[i].filename);
+        else
+            printf("%12zu%12zu%7.1f%%  %s\n", ls->hits, ls->misses, pct,
+                   stats[i].filename);
+    }
+}
+
+/*
+ * printsyscalls - prints, for each trace, the system calls memlib made for
+ * the allocator in one timed run
+ */
+static void printsyscalls(size_t n, const stats_t *stats) {
+    if (sparse_mode) {
+        printlookups(n, stats);
+        return;
+    }
+    puts("\nmemlib system calls per timed run:");
+    if (tab_mode)
+        printf("sbrks\tmprotect\tmadvise\tmmap\tmunmap\tper-Kop\ttrace\n");
+    else
+        printf("%7s%9s%9s%7s%7s%9s  %s\n", "sbrks", "mprotect", "madvise",
+               "mmap", "munmap", "per-Kop", "trace");
+
+    for (size_t i = 0; i < n; i++) {
+        const mem_syscalls_t *sc = &stats[i].syscalls;
+        size_t total = sc->mprotect + sc->madvise + sc->mmap + sc->munmap;
+        double per_kop =
+            stats[i].ops > 0 ? (double)total * 1000.0 / stats[i].ops : 0.0;
+        if (tab_mode)
+            printf("%zu\t%zu\t%zu\t%zu\t%zu\t%.2f\t%s\n",
+                   stats[i].run_sbrks, sc->mprotect, sc->madvise, sc->mmap,
+                   sc->munmap, per_kop, stats[i].filename);
+        else
+            printf("%7zu%9zu%9zu%7zu%7zu%9.2f  %s\n", stats[i].run_sbrks,
+                   sc->mprotect, sc->madvise, sc->mmap, sc->munmap, per_kop,
+                   stats[i].filename);
+    }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1518,7 +2600,7 @@ void unix_error(const char *fmt, ...) {
 void malloc_error(const trace_t *trace, unsigned int opnum, const char *fmt,
                   ...) {
 
-    errors++;
+    __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
     fprintf(stderr, "ERROR [trace %s, line %d]: ", trace->filename,
             trace->ops[opnum].lineno);
 
@@ -1703,23 +2785,85 @@ static unsigned int atoui_or_usage(const char *arg, const char *option,
     return (unsigned int)val;
 }
 
+/*
+ * name_or_usage - Return the index of arg in names, or print usage and
+ *    exit if it is not there
+ */
+static unsigned int name_or_usage(const char *arg, const char *const *names,
+                                  unsigned int num_names, const char *prog) {
+    for (unsigned int i = 0; i < num_names; i++) {
+        if (strcmp(arg, names[i]) == 0)
+            return i;
+    }
+    fprintf(stderr, "Unknown argument '%s'\n", arg);
+    usage(prog);
+    exit(1);
+}
+
+/*
+ * size_or_usage - Convert a size in bytes, with an optional K or M
+ *    suffix, or print usage and exit if it isn't one
+ */
+static size_t size_or_usage(const char *arg, const char *option,
+                            const char *prog) {
+    char *endp;
+    errno = 0;
+    unsigned long val = strtoul(arg, &endp, 10);
+    unsigned int shift = 0;
+    if (*endp == 'K' || *endp == 'k')
+        shift = 10;
+    else if (*endp == 'M' || *endp == 'm')
+        shift = 20;
+    if (shift > 0)
+        endp++;
+    if (endp == arg || *endp != '\0' || errno || val > (SIZE_MAX >> shift)) {
+        fprintf(stderr, "%s: invalid argument to option '%s' -- '%s'\n", prog,
+                option, arg);
+        usage(prog);
+        exit(1);
+    }
+    return (size_t)val << shift;
+}
+
 /*
  * usage - Explain the command line arguments
  */
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlBVCdDHLRSX] [-f <file>] [-j <n>] "
+                    "[-r <mode>] [-g <pages>]\n\t[-G <size>]\n", prog);
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-B         Time each trace on small and on huge "
+                    "pages too.\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> twice, check for "
                     "correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-g <pages> Put the heap on small pages (the "
+                    "default), transparent\n\t           huge pages (thp), "
+                    "or MAP_HUGETLB pages (hugetlb).\n");
+    fprintf(stderr, "\t-G <size>  Make the heap accessible <size> bytes "
+                    "(K, M suffixes allowed)\n\t           at a time, "
+                    "instead of a page at a time.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Report hardware events per op.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report p50/p99/p999 latency of each op.\n");
+    fprintf(stderr, "\t-r <mode>  Reset the heap between runs by releasing "
+                    "the pages used\n\t           (cold, the default), "
+                    "zeroing them (warm), or remapping it\n\t           "
+                    "all (remap).\n");
+    fprintf(stderr, "\t-R         Report the cost of resetting the heap "
+                    "between timed runs.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
+    fprintf(stderr, "\t-S         Report memlib's system calls in each timed "
+                    "run (page\n\t           lookups, in sparse mode).\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-j <n>     Replay traces on <n> threads (mdriver-mt "
+                    "only).\n");
+    fprintf(stderr, "\t-X         With -j, free blocks on another thread.\n");
 }
@@ -36,6 +36,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -59,31 +60,80 @@ void markGlobalsUninit(void);
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK {
     size_t id;         /* Page ID.  Counts number of pages from start of heap */
-    struct MBLK *next; /* Link for hash table */
+    struct MBLK *next; /* Link for the free page list */
+    struct MBLK *region_next; /* Link for the page list of a mapped region */
     unsigned char initSet[SPARSE_PAGE_SIZE / 8];
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A region mapped by mem_map */
+typedef struct {
+    unsigned char *lo;  /* Start address, page aligned */
+    size_t size;        /* Length in bytes, a multiple of the page size */
+    mem_block_t *pages; /* Emulated pages backing the region (sparse) */
+} mem_region_t;
+
+/* An sbrk-style heap with a break of its own */
+struct mem_arena {
+    unsigned char *lo;        /* Starting address */
+    unsigned char *brk;       /* Current position of break */
+    unsigned char *brk_chunk; /* ditto, rounded up to a whole page */
+    unsigned char *rw_end;    /* End of the accessible pages: brk_chunk, or
+                                 above it after a warm reset */
+    unsigned char *max_addr;  /* Maximum allowable break */
+};
+
 /* private global variables */
-static bool sparse = false;    /* Use sparse memory emulation */
-static unsigned char *heap;    /* Starting address of heap */
-static unsigned char *mem_brk; /* Current position of break */
-static unsigned char
-    *mem_brk_chunk; /* ditto, rounded up to a whole allocation chunk */
-static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static bool sparse = false; /* Use sparse memory emulation */
+static unsigned char *heap; /* Starting address of heap (the first arena) */
+static unsigned char *mem_max_addr; /* End of the address space of arenas */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
     false; /* Has information been printed about allocation */
+static size_t sbrk_calls = 0; /* Calls to mem_sbrk since the last reset */
+static mem_reset_mode_t reset_mode = MEM_RESET_COLD; /* See memlib.h */
+static unsigned char *warm_top; /* Warm resets leave [warm_top, mem_max_addr)
+                                   accessible for the arenas to come */
+static mem_page_mode_t page_mode = MEM_PAGES_SMALL; /* See memlib.h */
+static mem_page_mode_t pages_got = MEM_PAGES_SMALL; /* What mem_init got */
+static size_t prot_granule; /* Unit of protection changes: the page size of
+                               the heap */
+static size_t sbrk_granule_wanted = 0; /* See mem_set_sbrk_granule */
+static size_t sbrk_granule; /* Unit mem_sbrk makes memory accessible in: a
+                               multiple of prot_granule */
+static mem_syscalls_t syscalls; /* System calls since the last reset */
+
+/* Arenas. arenas[0] is the heap; the others are carved off the top of its
+ * address space, so arenas[0].max_addr is where the next one ends */
+static mem_arena_t arenas[MAX_ARENAS];
+static size_t num_arenas = 0;  /* Number of arenas, including the heap */
+static size_t arena_bytes = 0; /* Total size of the arenas */
+
+/* Mapped regions */
+static mem_region_t *regions = NULL; /* Regions, sorted by start address */
+static size_t num_regions = 0;       /* Number of mapped regions */
+static size_t max_regions = 0;       /* Capacity of the regions array */
+static bool regions_busy = false;    /* Set while the array is changed */
+static size_t mapped_bytes = 0;      /* Total size of the mapped regions */
+static size_t peak_bytes = 0; /* Largest heap plus region size since reset */
+static unsigned char *region_brk; /* Sparse: end of the used region space */
 
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
+static mem_block_t *free_page_list = NULL; /* Pages released by mem_unmap */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
-static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
-static size_t num_buckets = 0;             /* Number of buckets in page table */
+static mem_block_t **page_table = NULL;    /* Hash table from page ID to page,
+                                              open addressed */
+static size_t num_buckets = 0;    /* Number of slots in page table, a power of
+                                     two */
+static unsigned int table_shift;  /* 64 - log2(num_buckets) */
+static mem_block_t *page_tlb[PAGE_TLB_ENTRIES]; /* Recently used pages, by
+                                                   ID modulo the size */
+static mem_tlb_stats_t tlb_stats; /* Lookups in page_tlb since mem_init */
 
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
@@ -113,7 +163,32 @@ const char *__msan_default_options(void) {
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static mem_block_t *get_page(const void *addr);
+static void track_init(mem_block_t *block, size_t offset, size_t len,
+                       bool isWrite);
+static unsigned char *span_mem(const void *addr, size_t len, bool isWrite);
+static size_t page_left(const void *addr);
 static void print_stats(void);
+static mem_region_t *find_region(const void *addr, size_t len);
+static void unmap_regions(void);
+static void update_peak(void);
+static void reset_arenas(void);
+static unsigned char *reset_dense(void);
+static void *map_dense(void *start, bool fixed);
+static mem_arena_t *find_arena(const void *addr, size_t len);
+static int shrink_brk(mem_arena_t *arena, unsigned char *new_brk);
+static void lock_regions(void);
+static void unlock_regions(void);
+static mem_block_t *find_page(size_t id);
+static void release_page(mem_block_t *page);
+static void *emulate_memcpy(void *dst, const void *src, size_t num_bytes);
+static void *emulate_memset(void *dst, int c, size_t num_bytes);
+static void *native_memcpy(void *dst, const void *src, size_t num_bytes);
+static void *native_memset(void *dst, int c, size_t num_bytes);
+
+/* memcpy and memset as the heap needs them, chosen by mem_init */
+static void *(*memcpy_fn)(void *, const void *, size_t) = native_memcpy;
+static void *(*memset_fn)(void *, int, size_t) = native_memset;
 
 /*
  * Internal helpers
@@ -148,6 +223,10 @@ static inline void *round_address_up(void *addr, size_t align) {
  */
 void mem_init(bool do_sparse) {
     sparse = do_sparse;
+    /* Only emulated memory needs copying a word at a time; a dense heap
+     * is real memory, for libc's memcpy and memset at full speed */
+    memcpy_fn = sparse ? emulate_memcpy : native_memcpy;
+    memset_fn = sparse ? emulate_memset : native_memset;
     if (sparse) {
         /* Want sparse total allocation to approximately match the dense heap
          * size */
@@ -156,7 +235,12 @@ void mem_init(bool do_sparse) {
         double fbytes_per_page =
             sizeof(mem_block_t) + sizeof(mem_block_t *) / HASH_LOAD;
         num_pages = (size_t)(MAX_DENSE_HEAP / fbytes_per_page);
-        num_buckets = (size_t)((double)num_pages / HASH_LOAD);
+        num_buckets = 1;
+        table_shift = 64;
+        while ((double)num_buckets * HASH_LOAD < (double)num_pages) {
+            num_buckets *= 2;
+            table_shift--;
+        }
         mmap_length = num_buckets * sizeof(mem_block_t *) + // Page table
                       num_pages * sizeof(mem_block_t) +     // Pages
                       sizeof(uint64_t);                     // Padding
@@ -170,19 +254,24 @@ void mem_init(bool do_sparse) {
         mmap_length = MAX_DENSE_HEAP;
     }
 
-    void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
     /* The sparse heap is used for internal bookkeeping and is not
        exposed to student code.  The dense heap is used directly by
        student code.  We manage a pseudo-break within the dense heap
        by mapping it PROT_NONE initially and then changing pages to
        PROT_READ|PROT_WRITE upon calls to mem_sbrk.  */
-    int prot = sparse ? PROT_READ | PROT_WRITE : PROT_NONE;
-    void *addr = mmap(start,                       /* suggested start*/
-                      mmap_length,                 /* length */
-                      prot,                        /* access control */
-                      MAP_PRIVATE | MAP_ANONYMOUS, /* private anonymous mem */
-                      -1,                          /* fd */
-                      0);                          /* offset */
+    prot_granule = mem_pagesize();
+    pages_got = MEM_PAGES_SMALL;
+    void *addr;
+    if (sparse) {
+        addr = mmap(NULL,                        /* suggested start*/
+                    mmap_length,                 /* length */
+                    PROT_READ | PROT_WRITE,      /* access control */
+                    MAP_PRIVATE | MAP_ANONYMOUS, /* private anonymous mem */
+                    -1,                          /* fd */
+                    0);                          /* offset */
+    } else {
+        addr = map_dense(TRY_DENSE_HEAP_START, false);
+    }
     if (addr == MAP_FAILED) {
         fprintf(stderr,
                 "FAILURE.  mmap couldn't allocate space for heap (%s)\n",
@@ -204,9 +293,18 @@ void mem_init(bool do_sparse) {
         heap = addr;
         mem_max_addr = heap + mmap_length;
     }
+    sbrk_granule = prot_granule;
+    while (sbrk_granule < sbrk_granule_wanted)
+        sbrk_granule *= 2;
     stats_printed = false;
-    mem_brk = heap;
-    mem_brk_chunk = heap;
+    reset_arenas();
+    sbrk_calls = 0;
+    memset(&syscalls, 0, sizeof(syscalls));
+    memset(page_tlb, 0, sizeof(page_tlb));
+    memset(&tlb_stats, 0, sizeof(tlb_stats));
+    region_brk = mem_max_addr;
+    warm_top = mem_max_addr;
+    peak_bytes = 0;
 }
 
 /*
@@ -214,8 +312,13 @@ void mem_init(bool do_sparse) {
  */
 void mem_deinit(void) {
     print_stats();
+    unmap_regions();
+    free(regions);
+    regions = NULL;
+    max_regions = 0;
     munmap(heap, mmap_length);
     next_free_page = NULL;
+    free_page_list = NULL;
     num_free_pages = 0;
     page_table = NULL;
     num_buckets = 0;
@@ -225,52 +328,164 @@ void mem_deinit(void) {
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk(void) {
+    unsigned char *heap_rw_end = heap;
     print_stats();
+    unmap_regions();
     if (sparse) {
         /* Clear page table */
         size_t ptb = num_buckets * sizeof(mem_block_t *);
         memset((void *)page_table, 0, ptb);
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
+        free_page_list = NULL;
         num_free_pages = num_pages;
+        memset(page_tlb, 0, sizeof(page_tlb));
     } else {
-        /* In order to make subsequent calls to mem_sbrk cost
-           approximately what they did on the first pass, overwrite
-           the entire heap with a fresh PROT_NONE mapping.  */
-        if (mmap(heap, MAX_DENSE_HEAP, PROT_NONE,
-                 MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
-                 0) == MAP_FAILED) {
-            fprintf(stderr, "FAILURE.  deallocation of heap failed (%s)\n",
-                    strerror(errno));
-            exit(1);
-        }
+        heap_rw_end = reset_dense();
 #ifdef USE_MSAN
         /* Mark global variables as uninitialized */
         markGlobalsUninit();
 #endif
     }
-    mem_brk = heap;
-    mem_brk_chunk = heap;
+    reset_arenas();
+    arenas[0].rw_end = heap_rw_end;
+    sbrk_calls = 0;
+    memset(&syscalls, 0, sizeof(syscalls));
+    region_brk = mem_max_addr;
+    peak_bytes = 0;
+}
+
+/*
+ * mem_set_reset_mode - choose how mem_reset_brk empties a dense heap
+ */
+void mem_set_reset_mode(mem_reset_mode_t mode) {
+    reset_mode = mode;
+}
+
+/*
+ * mem_set_page_mode - choose the kind of pages for a dense heap
+ */
+void mem_set_page_mode(mem_page_mode_t mode) {
+    page_mode = mode;
+}
+
+/*
+ * mem_set_sbrk_granule - choose how far ahead of the break mem_sbrk makes
+ * the heap accessible
+ */
+void mem_set_sbrk_granule(size_t size) {
+    sbrk_granule_wanted = size;
+}
+
+/*
+ * mem_sbrk_granule - return the unit mem_sbrk makes the heap accessible in
+ */
+size_t mem_sbrk_granule(void) {
+    return sbrk_granule;
+}
+
+/*
+ * mem_syscalls - return the system calls made for the allocator since the
+ * heap was last reset
+ */
+mem_syscalls_t mem_syscalls(void) {
+    return syscalls;
+}
+
+/*
+ * mem_tlb_stats - return the lookups of emulated pages since mem_init
+ */
+mem_tlb_stats_t mem_tlb_stats(void) {
+    return tlb_stats;
+}
+
+/*
+ * mem_page_mode - return the kind of pages the heap got
+ */
+mem_page_mode_t mem_page_mode(void) {
+    return pages_got;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap and returns the old break; the pages
+ * given back are released, and read as zero if the heap grows again.
  */
 void *mem_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+    return mem_arena_sbrk(&arenas[0], incr);
+}
 
-    if (incr < 0) {
+/*
+ * mem_arena_create - carve a new arena of size bytes (rounded up to whole
+ * pages) off the top of the heap's address space. The heap can no longer
+ * grow into it. Arenas last until the heap is reset.
+ */
+mem_arena_t *mem_arena_create(size_t size) {
+    /* Whole huge pages, on a huge heap, so the arena starts on one */
+    size_t rsize = (size + prot_granule - 1) & ~(prot_granule - 1);
+    mem_arena_t *base = &arenas[0];
+
+    if (size == 0 || rsize < size || num_arenas == MAX_ARENAS ||
+        rsize > (size_t)(base->max_addr - base->brk_chunk)) {
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
-        errno = EINVAL;
-        return (void *)-1;
+                "ERROR: mem_arena_create failed.  No room for an arena of "
+                "%zu bytes\n",
+                size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    base->max_addr -= rsize;
+    mem_arena_t *arena = &arenas[num_arenas++];
+    arena->lo = base->max_addr;
+    arena->brk = arena->lo;
+    arena->brk_chunk = arena->lo;
+    arena->max_addr = arena->lo + rsize;
+    /* Pages the heap had made accessible above its new limit are the new
+     * arena's now, untouched */
+    arena->rw_end = arena->lo;
+    if (base->rw_end > arena->lo) {
+        arena->rw_end =
+            base->rw_end < arena->max_addr ? base->rw_end : arena->max_addr;
+        base->rw_end = arena->lo;
+    }
+    if (arena->lo >= warm_top)
+        arena->rw_end = arena->max_addr;
+    return arena;
+}
+
+/*
+ * mem_arena_default - return the arena that mem_sbrk works on
+ */
+mem_arena_t *mem_arena_default(void) {
+    return &arenas[0];
+}
+
+/*
+ * mem_arena_sbrk - mem_sbrk on a given arena
+ */
+void *mem_arena_sbrk(mem_arena_t *arena, intptr_t incr) {
+    unsigned char *old_brk = arena->brk;
+
+    sbrk_calls++;
+
+    if (incr < 0) {
+        if ((uintptr_t)-incr > (uintptr_t)(arena->brk - arena->lo)) {
+            fprintf(stderr,
+                    "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                    "bytes, but it is only %td bytes\n",
+                    -(long)incr, arena->brk - arena->lo);
+            errno = EINVAL;
+            return (void *)-1;
+        }
+        if (shrink_brk(arena, old_brk + incr) == -1) {
+            return (void *)-1;
+        }
+        return old_brk;
     }
-    if (mem_brk + incr > mem_max_addr) {
-        ptrdiff_t alloc = mem_brk - heap + incr;
+    if (incr > arena->max_addr - arena->brk) {
+        ptrdiff_t alloc = arena->brk - arena->lo + incr;
         fprintf(stderr,
                 "ERROR: mem_sbrk failed. Ran out of memory.  Would require "
                 "heap size of %td (0x%zx) bytes\n",
@@ -280,40 +495,176 @@ void *mem_sbrk(intptr_t incr) {
     }
 
     unsigned char *new_brk = old_brk + incr;
-    unsigned char *new_brk_chunk = round_address_up(new_brk, mem_pagesize());
+    unsigned char *new_brk_chunk = round_address_up(new_brk, prot_granule);
     if (!sparse) {
         /* Make the requested section of the heap be accessible.
          * sbrk accepts any 'incr' value, but mprotect only works on
-         * full pages.
+         * full pages.  Go a whole granule past the break, so that an
+         * allocator growing in small steps doesn't cost a system call
+         * each; after a warm reset, the pages may be accessible already.
          */
-        if (new_brk_chunk > mem_brk_chunk &&
-            mprotect(mem_brk_chunk, (size_t)(new_brk_chunk - mem_brk_chunk),
-                     PROT_READ | PROT_WRITE) == -1) {
-            fprintf(stderr,
-                    "ERROR: making %zd bytes at %p accessible failed (%s)\n",
-                    new_brk_chunk - mem_brk_chunk, (void *)mem_brk_chunk,
-                    strerror(errno));
-            return (void *)-1;
+        if (new_brk_chunk > arena->rw_end) {
+            unsigned char *new_rw_end = round_address_up(new_brk, sbrk_granule);
+            if (new_rw_end > arena->max_addr)
+                new_rw_end = arena->max_addr;
+            syscalls.mprotect++;
+            if (mprotect(arena->rw_end, (size_t)(new_rw_end - arena->rw_end),
+                         PROT_READ | PROT_WRITE) == -1) {
+                fprintf(stderr,
+                        "ERROR: making %zd bytes at %p accessible failed "
+                        "(%s)\n",
+                        new_rw_end - arena->rw_end, (void *)arena->rw_end,
+                        strerror(errno));
+                return (void *)-1;
+            }
+            arena->rw_end = new_rw_end;
         }
 #ifdef USE_ASAN
         /* Tell ASan the precise location of the break.  */
         __asan_unpoison_memory_region(old_brk, (size_t)incr);
-        if (new_brk < new_brk_chunk) {
+        if (new_brk < arena->rw_end) {
             __asan_poison_memory_region(new_brk,
-                                        (size_t)(new_brk_chunk - new_brk));
+                                        (size_t)(arena->rw_end - new_brk));
         }
 #endif
 #ifdef USE_MSAN
         /* Mark the requested section of the heap as uninitialized.  */
-        __msan_allocated_memory(mem_brk, (size_t)incr);
+        __msan_allocated_memory(old_brk, (size_t)incr);
 #endif
     }
 
-    mem_brk_chunk = new_brk_chunk;
-    mem_brk = new_brk;
+    arena->brk_chunk = new_brk_chunk;
+    /* Atomic, since mem_in_heap and mem_arena_hi may be reading it on
+     * other threads: a thread-safe allocator calls mem_arena_hi without
+     * its sbrk lock, and so does mdriver -j with mem_in_heap */
+    __atomic_store_n(&arena->brk, new_brk, __ATOMIC_RELAXED);
+    arena_bytes += (size_t)incr;
+    update_peak();
     return old_brk;
 }
 
+/*
+ * mem_map - simple model of mmap for an anonymous private mapping. Maps
+ * a region of size bytes (rounded up to whole pages) away from the heap.
+ * Regions share the dense heap's memory budget; emulated regions are laid
+ * out after the end of the sparse heap.
+ */
+void *mem_map(size_t size) {
+    size_t pagesize = mem_pagesize();
+    size_t rsize = (size + pagesize - 1) & ~(pagesize - 1);
+    unsigned char *addr;
+
+    if (size == 0 || rsize < size) {
+        fprintf(stderr, "ERROR: mem_map failed.  Invalid size %zu\n", size);
+        errno = EINVAL;
+        return (void *)-1;
+    }
+    size_t limit = sparse ? MAX_SPARSE_HEAP : mmap_length;
+    size_t used = sparse ? (size_t)(region_brk - mem_max_addr)
+                         : arena_bytes + mapped_bytes;
+    if (rsize > limit - used) {
+        fprintf(stderr,
+                "ERROR: mem_map failed. Ran out of memory.  Would require "
+                "%zu (0x%zx) bytes of regions\n",
+                mapped_bytes + rsize, mapped_bytes + rsize);
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    lock_regions();
+    if (num_regions == max_regions) {
+        size_t new_max = max_regions ? 2 * max_regions : 64;
+        mem_region_t *new_regions =
+            realloc(regions, new_max * sizeof(mem_region_t));
+        if (new_regions == NULL) {
+            unlock_regions();
+            fprintf(stderr, "ERROR: mem_map failed.  No room for regions\n");
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        regions = new_regions;
+        max_regions = new_max;
+    }
+
+    if (sparse) {
+        addr = region_brk;
+        region_brk += rsize;
+    } else {
+        syscalls.mmap++;
+        addr = mmap(NULL, rsize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            unlock_regions();
+            fprintf(stderr, "ERROR: mapping %zu bytes failed (%s)\n", rsize,
+                    strerror(errno));
+            return (void *)-1;
+        }
+#ifdef USE_MSAN
+        /* Mark the region as uninitialized */
+        __msan_allocated_memory(addr, rsize);
+#endif
+    }
+
+    /* Keep the regions sorted by address */
+    size_t i = num_regions;
+    while (i > 0 && regions[i - 1].lo > addr) {
+        regions[i] = regions[i - 1];
+        i--;
+    }
+    regions[i].lo = addr;
+    regions[i].size = rsize;
+    regions[i].pages = NULL;
+    num_regions++;
+    unlock_regions();
+    mapped_bytes += rsize;
+    update_peak();
+    return addr;
+}
+
+/*
+ * mem_unmap - unmaps a whole region returned by mem_map
+ */
+int mem_unmap(void *addr, size_t size) {
+    size_t pagesize = mem_pagesize();
+    size_t rsize = (size + pagesize - 1) & ~(pagesize - 1);
+    mem_region_t *region = find_region(addr, 1);
+
+    if (region == NULL || region->lo != addr || region->size != rsize) {
+        fprintf(stderr,
+                "ERROR: mem_unmap failed.  %p:%zu is not a mapped region\n",
+                addr, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (sparse) {
+        /* Hand the emulated pages back */
+        mem_block_t *page = region->pages;
+        while (page != NULL) {
+            mem_block_t *region_next = page->region_next;
+            release_page(page);
+            page = region_next;
+        }
+        /* The last region's addresses can be handed out again */
+        if (region->lo + rsize == region_brk)
+            region_brk = region->lo;
+    } else {
+        syscalls.munmap++;
+        if (munmap(addr, rsize) == -1) {
+            fprintf(stderr, "ERROR: unmapping %zu bytes at %p failed (%s)\n",
+                    rsize, addr, strerror(errno));
+            return -1;
+        }
+    }
+
+    mapped_bytes -= rsize;
+    lock_regions();
+    num_regions--;
+    size_t i = (size_t)(region - regions);
+    memmove(region, region + 1, (num_regions - i) * sizeof(mem_region_t));
+    unlock_regions();
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -325,14 +676,63 @@ void *mem_heap_lo(void) {
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi(void) {
-    return (void *)(mem_brk - 1);
+    return (void *)(arenas[0].brk - 1);
 }
 
 /*
  * mem_heapsize - returns the heap size in bytes
  */
 size_t mem_heapsize(void) {
-    return (size_t)(mem_brk - heap);
+    return (size_t)(arenas[0].brk - heap);
+}
+
+/*
+ * mem_arena_lo - return address of the first byte of an arena
+ */
+void *mem_arena_lo(const mem_arena_t *arena) {
+    return (void *)arena->lo;
+}
+
+/*
+ * mem_arena_hi - return address of the last byte of an arena
+ */
+void *mem_arena_hi(const mem_arena_t *arena) {
+    return (void *)(__atomic_load_n(&arena->brk, __ATOMIC_RELAXED) - 1);
+}
+
+/*
+ * mem_arena_size - returns the size of an arena in bytes
+ */
+size_t mem_arena_size(const mem_arena_t *arena) {
+    return (size_t)(arena->brk - arena->lo);
+}
+
+/*
+ * mem_mapsize - returns the total size of the mapped regions in bytes
+ */
+size_t mem_mapsize(void) {
+    return mapped_bytes;
+}
+
+/*
+ * mem_peaksize - returns the largest heap size plus mapped region size
+ * since the last reset
+ */
+size_t mem_peaksize(void) {
+    return peak_bytes;
+}
+
+/*
+ * mem_in_heap - true if the len bytes at addr lie in a single arena (the
+ * heap, usually) or in a single mapped region
+ */
+bool mem_in_heap(const void *addr, size_t len) {
+    if (find_arena(addr, len) != NULL)
+        return true;
+    lock_regions();
+    bool found = find_region(addr, len) != NULL;
+    unlock_regions();
+    return found;
 }
 
 /*
@@ -351,8 +751,43 @@ size_t mem_pagesize(void) {
     return pagesize;
 }
 
+/*
+ * mem_sbrk_calls - return the number of calls to mem_sbrk since the heap
+ * was last reset
+ */
+size_t mem_sbrk_calls(void) {
+    return sbrk_calls;
+}
+
+/*
+ * mem_sbrk_zeroed - true if memory handed out by mem_sbrk or mem_map is
+ * always zero. The dense heap is a fresh anonymous mapping after every
+ * mem_reset_brk, memory given back by shrinking the break is cleared, and
+ * regions are fresh mappings too. Emulated pages are reused without being
+ * cleared (and reading them before writing is UB).
+ */
+bool mem_sbrk_zeroed(void) {
+#ifdef USE_MSAN
+    /* Zero, but marked uninitialized by mem_sbrk */
+    return false;
+#else
+    return !sparse;
+#endif
+}
+
 /*************** Memory emulation  *******************/
 
+/* Is the len bytes at addr emulated memory (an arena or a region)? */
+static inline bool is_emulated(const void *addr, size_t len) {
+    const unsigned char *p = addr;
+    if (p >= heap && p + len <= arenas[0].brk)
+        return true;
+    if (p >= heap && p < mem_max_addr)
+        return num_arenas > 1 && find_arena(addr, len) != NULL;
+    return p >= mem_max_addr && p < region_brk &&
+           find_region(addr, len) != NULL;
+}
+
 __int128_t mem_read128(const void *addr) {
     __int128_t r;
     r = (((__int128_t)mem_read((char *)addr + 8, 8)) << 64) | mem_read(addr, 8);
@@ -368,8 +803,7 @@ void mem_write128(void *addr, __int128_t val) {
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (sparse && is_emulated(addr, len)) {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
@@ -407,8 +841,7 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (sparse && is_emulated(addr, len)) {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
@@ -445,43 +878,61 @@ void mem_write(void *addr, uint64_t val, size_t len) {
     }
 }
 
-/* Emulation of memcpy */
-void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
-    void *savedst = dst;
-    size_t word_size = sizeof(uint64_t);
-    while (num_bytes >= word_size) {
-        uint64_t data = mem_read(src, word_size);
-        mem_write(dst, data, word_size);
-        num_bytes -= word_size;
-        src = (void *)((unsigned char *)src + word_size);
-        dst = (void *)((unsigned char *)dst + word_size);
+/*
+ * Emulation of memcpy.  The bytes are copied in spans that lie in one
+ * emulated page on each side, looking each page up once per span
+ */
+static void *emulate_memcpy(void *dst, const void *src, size_t num_bytes) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    while (num_bytes > 0) {
+        size_t len = num_bytes;
+        if (len > page_left(s))
+            len = page_left(s);
+        if (len > page_left(d))
+            len = page_left(d);
+        const unsigned char *from = span_mem(s, len, false);
+        memmove(span_mem(d, len, true), from, len);
+        num_bytes -= len;
+        s += len;
+        d += len;
     }
-    if (num_bytes) {
-        uint64_t data = mem_read(src, num_bytes);
-        mem_write(dst, data, num_bytes);
+    return dst;
+}
+
+/* Emulation of memset, a span of one emulated page at a time */
+static void *emulate_memset(void *dst, int c, size_t num_bytes) {
+    unsigned char *d = dst;
+    while (num_bytes > 0) {
+        size_t len = num_bytes < page_left(d) ? num_bytes : page_left(d);
+        memset(span_mem(d, len, true), c, len);
+        num_bytes -= len;
+        d += len;
     }
-    return savedst;
+    return dst;
+}
+
+/*
+ * native_memcpy, native_memset - libc's memcpy and memset, for a dense heap.
+ * Calls rather than pointers to libc, so ASan and MSan check and track the
+ * bytes as they do for any other memcpy in the build
+ */
+static void *native_memcpy(void *dst, const void *src, size_t num_bytes) {
+    return memcpy(dst, src, num_bytes);
+}
+
+static void *native_memset(void *dst, int c, size_t num_bytes) {
+    return memset(dst, c, num_bytes);
+}
+
+/* Replacement for memcpy in the allocator */
+void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
+    return memcpy_fn(dst, src, num_bytes);
 }
 
-/* Emulation of memset */
+/* Replacement for memset in the allocator */
 void *mem_memset(void *dst, int c, size_t num_bytes) {
-    void *savedst = dst;
-    uint64_t byte = c & 0xFF;
-    uint64_t data = 0;
-    size_t word_size = sizeof(uint64_t);
-    size_t i;
-    for (i = 0; i < word_size; i++) {
-        data = data | (byte << (8 * i));
-    }
-    while (num_bytes >= word_size) {
-        mem_write(dst, data, word_size);
-        num_bytes -= word_size;
-        dst = (void *)((unsigned char *)dst + word_size);
-    }
-    if (num_bytes) {
-        mem_write(dst, data, num_bytes);
-    }
-    return savedst;
+    return memset_fn(dst, c, num_bytes);
 }
 
 /* Function to aid in viewing contents of heap */
@@ -522,14 +973,359 @@ static void print_stats(void) {
         printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes "
                "(%.4f%% density).  Max address = %p\n",
                ppages, num_pages, pbytes, vbytes,
-               100.0 * (double)pbytes / (double)vbytes, (void *)mem_brk);
+               100.0 * (double)pbytes / (double)vbytes,
+               (void *)arenas[0].brk);
+        printf("Page lookups: %zu cached, %zu from the page table\n",
+               tlb_stats.hits, tlb_stats.misses);
     } else {
         printf("Allocated %zu heap bytes.  Max address = %p\n", vbytes,
-               (void *)mem_brk);
+               (void *)arenas[0].brk);
     }
     stats_printed = true;
 }
 
+/* Find the mapped region holding the len bytes at addr, if there is one */
+static mem_region_t *find_region(const void *addr, size_t len) {
+    const unsigned char *p = addr;
+    size_t lo = 0;
+    size_t hi = num_regions;
+    /* Find the last region starting at or before addr */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (regions[mid].lo <= p)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    mem_region_t *region = &regions[lo - 1];
+    size_t offset = (size_t)(p - region->lo);
+    if (offset >= region->size || len > region->size - offset)
+        return NULL;
+    return region;
+}
+
+/* Move the break of an arena down to new_brk, releasing the pages above */
+static int shrink_brk(mem_arena_t *arena, unsigned char *new_brk) {
+    unsigned char *old_brk = arena->brk;
+
+    if (!sparse) {
+        unsigned char *new_brk_chunk = round_address_up(new_brk, prot_granule);
+        if (new_brk_chunk < arena->rw_end) {
+            /* Drop the contents first, so the pages are fresh zero pages
+             * when the heap grows back over them.  Pages a warm reset
+             * kept above the break go too, but the granule the break is
+             * in stays accessible, as mem_sbrk would have left it. */
+            size_t len = (size_t)(arena->rw_end - new_brk_chunk);
+            unsigned char *keep = round_address_up(new_brk, sbrk_granule);
+            if (keep > arena->rw_end)
+                keep = arena->rw_end;
+            syscalls.madvise++;
+            int err = madvise(new_brk_chunk, len, MADV_DONTNEED);
+            if (err == 0 && keep < arena->rw_end) {
+                syscalls.mprotect++;
+                err = mprotect(keep, (size_t)(arena->rw_end - keep),
+                               PROT_NONE);
+            }
+            if (err == -1) {
+                fprintf(stderr,
+                        "ERROR: releasing %zu bytes at %p failed (%s)\n", len,
+                        (void *)new_brk_chunk, strerror(errno));
+                return -1;
+            }
+            arena->rw_end = keep;
+        }
+        arena->brk_chunk = new_brk_chunk;
+        /* The rest of the new last page stays mapped; clear what was
+         * handed out of it */
+        unsigned char *dirty_end =
+            old_brk < new_brk_chunk ? old_brk : new_brk_chunk;
+        memset(new_brk, 0, (size_t)(dirty_end - new_brk));
+#ifdef USE_ASAN
+        __asan_poison_memory_region(new_brk, (size_t)(dirty_end - new_brk));
+#endif
+    } else {
+        /* Release the pages that lie wholly above the new break, looking
+         * them up by ID or by scanning the page table, whichever is less */
+        size_t first = page_id(round_address_up(new_brk, SPARSE_PAGE_SIZE));
+        size_t end = page_id(round_address_up(old_brk, SPARSE_PAGE_SIZE));
+        if (end > first && end - first <= num_pages - num_free_pages) {
+            for (size_t id = first; id < end; id++) {
+                mem_block_t *page = find_page(id);
+                if (page != NULL)
+                    release_page(page);
+            }
+        } else if (end > first) {
+            for (size_t b = 0; b < num_buckets; b++) {
+                /* Releasing a page moves a later one into its slot */
+                mem_block_t *page;
+                while ((page = page_table[b]) != NULL && page->id >= first &&
+                       page->id < end)
+                    release_page(page);
+            }
+        }
+        /* Bytes above the break in the new last page are unwritten again */
+        mem_block_t *page = find_page(page_id(new_brk));
+        if (page != NULL) {
+            size_t offset = (size_t)(new_brk - (unsigned char *)page_start(
+                                                   page->id));
+            for (size_t i = offset; i < SPARSE_PAGE_SIZE; i++)
+                page->initSet[i / 8] &= (unsigned char)~(1 << (i % 8));
+        }
+    }
+
+    arena_bytes -= (size_t)(old_brk - new_brk);
+    __atomic_store_n(&arena->brk, new_brk, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * lock_regions, unlock_regions - Keep mem_in_heap on another thread out of
+ * the regions array while mem_map or mem_unmap change it. Only a driver
+ * replaying a trace on several threads (mdriver -j) needs this; the
+ * allocator already makes its own calls to memlib one at a time.
+ */
+static void lock_regions(void) {
+    while (__atomic_test_and_set(&regions_busy, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void unlock_regions(void) {
+    __atomic_clear(&regions_busy, __ATOMIC_RELEASE);
+}
+
+/* The page table slot where the search for a page ID starts */
+static inline size_t page_slot(size_t id) {
+    /* Fibonacci hashing: IDs of neighbouring pages spread out */
+    return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ULL) >> table_shift);
+}
+
+/*
+ * Find the emulated page with a given ID, if it has been allocated.  Most
+ * accesses fall on a page used a moment ago, so the last page looked up in
+ * each of a few sets is kept in page_tlb, where finding it costs one
+ * comparison
+ */
+static mem_block_t *find_page(size_t id) {
+    mem_block_t **entry = &page_tlb[id % PAGE_TLB_ENTRIES];
+    if (*entry != NULL && (*entry)->id == id) {
+        tlb_stats.hits++;
+        return *entry;
+    }
+    tlb_stats.misses++;
+
+    size_t mask = num_buckets - 1;
+    for (size_t b = page_slot(id);; b = (b + 1) & mask) {
+        mem_block_t *page = page_table[b];
+        if (page == NULL)
+            return NULL;
+        if (page->id == id) {
+            *entry = page;
+            return page;
+        }
+    }
+}
+
+/*
+ * Take an emulated page out of the page table and make it free.  Later
+ * pages in its run of slots move back to fill the hole, if their search
+ * would pass it, so that no search stops short of them
+ */
+static void release_page(mem_block_t *page) {
+    size_t mask = num_buckets - 1;
+    size_t hole = page_slot(page->id);
+    while (page_table[hole] != page)
+        hole = (hole + 1) & mask;
+    for (size_t b = (hole + 1) & mask; page_table[b] != NULL;
+         b = (b + 1) & mask) {
+        size_t home = page_slot(page_table[b]->id);
+        if (((b - home) & mask) >= ((b - hole) & mask)) {
+            page_table[hole] = page_table[b];
+            hole = b;
+        }
+    }
+    page_table[hole] = NULL;
+
+    if (page_tlb[page->id % PAGE_TLB_ENTRIES] == page)
+        page_tlb[page->id % PAGE_TLB_ENTRIES] = NULL;
+    page->next = free_page_list;
+    free_page_list = page;
+    num_free_pages++;
+}
+
+/* Unmap every region, e.g. when the heap is reset */
+static void unmap_regions(void) {
+    if (!sparse) {
+        for (size_t i = 0; i < num_regions; i++)
+            munmap(regions[i].lo, regions[i].size);
+    }
+    num_regions = 0;
+    mapped_bytes = 0;
+}
+
+/* Record a new peak of arena plus region memory */
+static void update_peak(void) {
+    size_t total = arena_bytes + mapped_bytes;
+    if (total > peak_bytes)
+        peak_bytes = total;
+}
+
+/* Go back to a single, empty arena: the heap */
+static void reset_arenas(void) {
+    arenas[0].lo = heap;
+    arenas[0].brk = heap;
+    arenas[0].brk_chunk = heap;
+    arenas[0].rw_end = heap;
+    arenas[0].max_addr = mem_max_addr;
+    num_arenas = 1;
+    arena_bytes = 0;
+}
+
+/*
+ * Empty the pages of a dense heap's arenas, the way reset_mode says, and
+ * return the end of the heap's pages that are left accessible.
+ */
+static unsigned char *reset_dense(void) {
+    if (reset_mode == MEM_RESET_REMAP) {
+        /* Overwrite the entire heap with a fresh PROT_NONE mapping,
+         * however little of it was used */
+        if (map_dense(heap, true) == MAP_FAILED) {
+            fprintf(stderr, "FAILURE.  deallocation of heap failed (%s)\n",
+                    strerror(errno));
+            exit(1);
+        }
+        warm_top = mem_max_addr;
+        return heap;
+    }
+
+    for (size_t i = 0; i < num_arenas; i++) {
+        mem_arena_t *arena = &arenas[i];
+        if (reset_mode == MEM_RESET_WARM) {
+            /* Keep the pages, but give them back zeroed, as fresh
+             * pages would be.  Above brk_chunk they are zero already */
+            size_t used = (size_t)(arena->brk_chunk - arena->lo);
+#ifdef USE_ASAN
+            __asan_unpoison_memory_region(arena->lo, used);
+#endif
+            memset(arena->lo, 0, used);
+#ifdef USE_ASAN
+            __asan_poison_memory_region(arena->lo, used);
+#endif
+            if (i > 0 && arena->lo < warm_top)
+                warm_top = arena->lo;
+            continue;
+        }
+        /* Only what was made accessible can have been touched, so this
+         * costs in proportion to the pages used; mem_sbrk will fault them
+         * in afresh */
+        size_t len = (size_t)(arena->rw_end - arena->lo);
+        if (len > 0 && (madvise(arena->lo, len, MADV_DONTNEED) == -1 ||
+                        mprotect(arena->lo, len, PROT_NONE) == -1)) {
+            fprintf(stderr, "FAILURE.  deallocation of heap failed (%s)\n",
+                    strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (reset_mode != MEM_RESET_WARM)
+        return heap;
+    /* Arenas are carved off the top in the same order every run, so keep
+     * the top of the address space accessible for them as one range */
+    if (warm_top < mem_max_addr &&
+        mprotect(warm_top, (size_t)(mem_max_addr - warm_top),
+                 PROT_READ | PROT_WRITE) == -1) {
+        fprintf(stderr, "FAILURE.  keeping the heap warm failed (%s)\n",
+                strerror(errno));
+        exit(1);
+    }
+    return arenas[0].rw_end;
+}
+
+/*
+ * Map the dense heap PROT_NONE, with the pages page_mode asks for, at start
+ * (exactly, if fixed).  If huge pages can't be had, warn once and make do
+ * with smaller ones.  Sets prot_granule and pages_got to match.
+ */
+static void *map_dense(void *start, bool fixed) {
+    static bool warned = false;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (fixed ? MAP_FIXED : 0);
+    const char *missing = NULL; /* Huge pages asked for but not had */
+    int err = 0;
+    void *addr;
+
+    if (page_mode == MEM_PAGES_HUGETLB) {
+#ifdef MAP_HUGETLB
+        /* Reserve the pages for the whole heap now: without the
+         * reservation, running out of them later is a SIGBUS */
+        addr = mmap(start, mmap_length, PROT_NONE, flags | MAP_HUGETLB, -1,
+                    0);
+        if (addr != MAP_FAILED) {
+            prot_granule = HUGE_PAGE_SIZE;
+            pages_got = MEM_PAGES_HUGETLB;
+            return addr;
+        }
+        err = errno;
+#else
+        err = ENOTSUP;
+#endif
+        missing = "MAP_HUGETLB";
+    }
+
+    if (page_mode != MEM_PAGES_SMALL) {
+#ifdef MADV_HUGEPAGE
+        /* Map a huge page more than needed, to start on a boundary */
+        size_t extra = fixed ? 0 : HUGE_PAGE_SIZE;
+        unsigned char *base = mmap(start, mmap_length + extra, PROT_NONE,
+                                   flags, -1, 0);
+        if (base == MAP_FAILED)
+            return MAP_FAILED;
+        unsigned char *lo = round_address_up(base, HUGE_PAGE_SIZE);
+        if (lo > base)
+            munmap(base, (size_t)(lo - base));
+        if (extra > (size_t)(lo - base))
+            munmap(lo + mmap_length, extra - (size_t)(lo - base));
+        if (madvise(lo, mmap_length, MADV_HUGEPAGE) == 0) {
+            if (missing != NULL && !warned) {
+                fprintf(stderr, "WARNING: %s failed (%s); using transparent "
+                                "huge pages\n",
+                        missing, strerror(err));
+                warned = true;
+            }
+            prot_granule = HUGE_PAGE_SIZE;
+            pages_got = MEM_PAGES_THP;
+            return lo;
+        }
+        munmap(lo, mmap_length);
+#endif
+        if (!warned)
+            fprintf(stderr, "WARNING: huge pages are unavailable; using "
+                            "%zu-byte pages\n",
+                    mem_pagesize());
+        warned = true;
+    }
+
+    prot_granule = mem_pagesize();
+    pages_got = MEM_PAGES_SMALL;
+    return mmap(start, mmap_length, PROT_NONE, flags, -1, 0);
+}
+
+/*
+ * Find the arena holding the len bytes at addr, if there is one. Under
+ * mdriver -j, other threads may move the breaks meanwhile; that cannot
+ * change the answer for a block that is allocated.
+ */
+static mem_arena_t *find_arena(const void *addr, size_t len) {
+    const unsigned char *p = addr;
+    for (size_t i = 0; i < num_arenas; i++) {
+        mem_arena_t *arena = &arenas[i];
+        unsigned char *brk = __atomic_load_n(&arena->brk, __ATOMIC_RELAXED);
+        if (p >= arena->lo && p <= brk && len <= (size_t)(brk - p))
+            return arena;
+    }
+    return NULL;
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr) {
     ptrdiff_t offset =
@@ -544,15 +1340,12 @@ static void *page_start(size_t id) {
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
-/* Get memory to store value.  Allocate page if necessary */
-static void *get_mem(const void *addr, size_t size, bool isWrite) {
+/* Find the page holding addr.  Allocate page if necessary */
+static mem_block_t *get_page(const void *addr) {
     size_t id = page_id(addr);
-    size_t b = id % num_buckets; // A very simple hash function
     unsigned int i;
 
-    mem_block_t *block = page_table[b];
-    while (block && block->id != id)
-        block = block->next;
+    mem_block_t *block = find_page(id);
     if (!block) {
         /* Need to allocate a new block */
         if (num_free_pages == 0) {
@@ -565,51 +1358,122 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        if (free_page_list != NULL) {
+            block = free_page_list;
+            free_page_list = block->next;
+        } else {
+            block = next_free_page++;
+        }
         num_free_pages--;
         block->id = id;
-        block->next = page_table[b];
+        block->next = NULL;
+        block->region_next = NULL;
+        /* Region pages are listed so that mem_unmap can release them */
+        if ((const unsigned char *)addr >= mem_max_addr) {
+            mem_region_t *region = find_region(addr, 1);
+            assert(region != NULL);
+            block->region_next = region->pages;
+            region->pages = block;
+        }
         for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
             block->initSet[i] = 0;
+        /* The table is never full: see HASH_LOAD */
+        size_t mask = num_buckets - 1;
+        size_t b = page_slot(id);
+        while (page_table[b] != NULL)
+            b = (b + 1) & mask;
         page_table[b] = block;
+        page_tlb[id % PAGE_TLB_ENTRIES] = block;
     }
+    return block;
+}
 
-    // Convert an emulated address into an offset
-    void *saddr = page_start(id);
-    ptrdiff_t offset = (unsigned char *)addr - (unsigned char *)saddr;
-    assert(offset >= 0);
-
+/*
+ * Record that len bytes of a page, from offset on, have been written (or,
+ * if isWrite is false, check that they have).  Whole bytes of the bit
+ * vector are set, or checked, eight bits at a time.
+ */
+static void track_init(mem_block_t *block, size_t offset, size_t len,
+                       bool isWrite) {
 #ifndef NO_CHECK_UB
-    // Compute the bit vector lookup for this 'offset'
-    size_t offsetIdx = (size_t)offset / 8;
-    size_t offsetBit = (size_t)offset & 0x7ul;
+    size_t end = offset + len;
+    assert(end <= SPARSE_PAGE_SIZE);
+    if (!isWrite && !checkUB)
+        return;
 
-    // For each byte in this access, update the bitvector that tracks
-    //  the use / initialization of emulated bytes.
-    for (i = 0; i < size; i++) {
+    while (offset < end) {
+        size_t idx = offset / 8;
+        size_t bit = offset % 8;
+        size_t nbits = end - offset < 8 - bit ? end - offset : 8 - bit;
+        if (bit == 0 && nbits == 8) {
+            /* Whole bytes of the bit vector at a time */
+            size_t nbytes = (end - offset) / 8;
+            if (isWrite) {
+                memset(&block->initSet[idx], 0xFF, nbytes);
+                offset += nbytes * 8;
+                continue;
+            }
+            size_t k = 0;
+            while (k < nbytes && block->initSet[idx + k] == 0xFF)
+                k++;
+            offset += k * 8;
+            if (k == nbytes)
+                continue;
+            idx += k;
+        }
+        unsigned char mask = (unsigned char)(((1u << nbits) - 1) << bit);
         if (isWrite) {
-            block->initSet[offsetIdx] |= (0x1 << offsetBit);
-        } else if (checkUB &&
-                   (block->initSet[offsetIdx] & (0x1 << offsetBit)) == 0) {
+            block->initSet[idx] |= mask;
+        } else if ((block->initSet[idx] & mask) != mask) {
             // The student code has attempted to read an address that was
             //  never written to.  Students should set a breakpoint on this
             //  line / check and then backtrace to where their code has
             //  made the memory access.
+            while ((block->initSet[idx] & (1u << bit)) != 0)
+                bit++;
             fprintf(stderr,
                     "Attempt to read uninitialized address %p, see %s:%d for "
                     "details\n",
-                    (addr + i), __FILE__, __LINE__);
+                    (void *)((unsigned char *)page_start(block->id) +
+                             idx * 8 + bit),
+                    __FILE__, __LINE__);
             abort();
         }
-        offsetBit++;
-        if (offsetBit == 8) {
-            offsetBit = 0;
-            offsetIdx++;
-        }
-        if (offsetIdx == (SPARSE_PAGE_SIZE / 8))
-            break;
+        offset = (idx + 1) * 8;
     }
 #endif
+}
+
+/* Get memory to store value.  Allocate page if necessary */
+static void *get_mem(const void *addr, size_t size, bool isWrite) {
+    mem_block_t *block = get_page(addr);
+
+    // Convert an emulated address into an offset
+    void *saddr = page_start(block->id);
+    ptrdiff_t offset = (unsigned char *)addr - (unsigned char *)saddr;
+    assert(offset >= 0);
+
+    // Update the bitvector that tracks the use / initialization of
+    //  emulated bytes, for the bytes of this access in this page.
+    size_t in_page = SPARSE_PAGE_SIZE - (size_t)offset;
+    track_init(block, (size_t)offset, size < in_page ? size : in_page,
+               isWrite);
 
     return (void *)&block->bytes[offset];
 }
+
+/*
+ * Find where the len bytes at addr are kept, for a bulk copy or fill that
+ * has been split at page boundaries: in their emulated page, if they are
+ * emulated, or at addr itself
+ */
+static unsigned char *span_mem(const void *addr, size_t len, bool isWrite) {
+    if (!is_emulated(addr, len))
+        return (unsigned char *)addr;
+    return get_mem(addr, len, isWrite);
+}
+
+/* Bytes from addr to the end of its emulated page */
+static size_t page_left(const void *addr) {
+    return SPARSE_PAGE_SIZE - (size_t)((uintptr_t)addr % SPARSE_PAGE_SIZE);
+}
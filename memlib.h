@@ -12,6 +12,13 @@
 #include <stdint.h>
 #include <unistd.h>
 
+/**
+ * @brief An independent sbrk-style heap, with a break of its own.
+ *
+ * The heap that mem_sbrk works on is an arena too (mem_arena_default).
+ */
+typedef struct mem_arena mem_arena_t;
+
 /**
  * @brief
  * @param[in] sparse
@@ -24,23 +31,194 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends (or shrinks) the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative incr
+ * moves the break back down and releases the memory above it; if the heap
+ * grows over that memory again, it reads as zero (see mem_sbrk_zeroed).
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
- *         breakpoint)
- * @pre `incr > 0`
+ *         breakpoint), or (void *)-1 on failure
+ * @pre `-incr <= mem_heapsize()`
  */
 void *mem_sbrk(intptr_t incr);
 
+/**
+ * @brief Creates a new arena, next to the heap.
+ *
+ * The arena's memory is taken from the top of the heap's address space, so
+ * the heap can no longer grow into it. Arenas share the heap's memory
+ * budget, work in both dense and sparse mode, and count towards
+ * mem_peaksize. Resetting the heap removes every arena but the heap.
+ *
+ * @param[in] size The most bytes the arena may grow to, rounded up to
+ *                 whole pages
+ * @return The new arena, or NULL if there is no room for it
+ */
+mem_arena_t *mem_arena_create(size_t size);
+
+/**
+ * @brief Returns the arena of the heap, the one mem_sbrk works on.
+ * @return The heap's arena
+ */
+mem_arena_t *mem_arena_default(void);
+
+/**
+ * @brief Extends (or shrinks) an arena by incr bytes, like mem_sbrk.
+ * @param[in] arena The arena
+ * @param[in] incr  The amount of bytes by which to extend the arena
+ * @return The start address of the new area (the previous break), or
+ *         (void *)-1 on failure
+ * @pre `-incr <= mem_arena_size(arena)`
+ */
+void *mem_arena_sbrk(mem_arena_t *arena, intptr_t incr);
+
+/**
+ * @brief Finds the low address of an arena.
+ * @param[in] arena The arena
+ * @return The address of the first valid byte in the arena
+ */
+void *mem_arena_lo(const mem_arena_t *arena);
+
+/**
+ * @brief Finds the high address of an arena (see mem_heap_hi).
+ * @param[in] arena The arena
+ * @return The address of the last valid byte in the arena
+ */
+void *mem_arena_hi(const mem_arena_t *arena);
+
+/**
+ * @brief Returns the number of bytes being used by an arena.
+ * @param[in] arena The arena
+ * @return The size of the arena, in bytes
+ */
+size_t mem_arena_size(const mem_arena_t *arena);
+
+/**
+ * @brief Maps a new region of memory, independent of the heap.
+ *
+ * This function is a simple model of an anonymous, private mmap(). Regions
+ * are not part of the heap as seen by mem_heap_lo and mem_heap_hi, but
+ * count towards mem_peaksize. Resetting the heap unmaps every region.
+ *
+ * @param[in] size The amount of bytes to map, rounded up to whole pages
+ * @return The page-aligned start address of the region, or (void *)-1 if
+ *         it could not be mapped
+ */
+void *mem_map(size_t size);
+
+/**
+ * @brief Unmaps a region returned by mem_map.
+ * @param[in] addr The start address of the region
+ * @param[in] size The size the region was mapped with
+ * @return 0 on success, -1 if addr and size do not name a mapped region
+ */
+int mem_unmap(void *addr, size_t size);
+
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
+ *
+ * In dense mode, the pages the heap used are emptied as mem_set_reset_mode
+ * says. Either way, the heap reads as zero when it grows again.
  */
 void mem_reset_brk(void);
 
+/**
+ * @brief How mem_reset_brk empties a dense heap.
+ */
+typedef enum {
+    MEM_RESET_COLD,  /**< Release the pages used (the default) */
+    MEM_RESET_WARM,  /**< Zero the pages used but keep them accessible, so
+                          later runs don't fault them in */
+    MEM_RESET_REMAP, /**< Map the whole heap afresh, used or not */
+} mem_reset_mode_t;
+
+/**
+ * @brief Sets how mem_reset_brk empties a dense heap.
+ *
+ * A warm heap leaves pages accessible above the break, so stray accesses
+ * just past it no longer fault. Call this before mem_init.
+ *
+ * @param[in] mode The way to reset the heap
+ */
+void mem_set_reset_mode(mem_reset_mode_t mode);
+
+/**
+ * @brief The kind of pages that back a dense heap.
+ */
+typedef enum {
+    MEM_PAGES_SMALL,   /**< Pages of the system's page size (the default) */
+    MEM_PAGES_THP,     /**< Transparent huge pages, by MADV_HUGEPAGE */
+    MEM_PAGES_HUGETLB, /**< Huge pages by MAP_HUGETLB, enough for all of
+                            MAX_DENSE_HEAP, from /proc/sys/vm/nr_hugepages */
+} mem_page_mode_t;
+
+/**
+ * @brief Sets the kind of pages that back a dense heap.
+ *
+ * With huge pages, the heap and its arenas start on a huge page boundary,
+ * and mem_sbrk makes memory accessible a huge page at a time, so stray
+ * accesses past the break fault less often. Mapped regions keep small
+ * pages. Call this before mem_init.
+ *
+ * @param[in] mode The kind of pages wanted
+ */
+void mem_set_page_mode(mem_page_mode_t mode);
+
+/**
+ * @brief Sets how far ahead of the break mem_sbrk makes a dense heap
+ *        accessible.
+ *
+ * Growing the heap across a page boundary costs an mprotect system call.
+ * With a larger granule, mem_sbrk makes memory accessible up to the next
+ * granule boundary at once, so an allocator growing in small steps makes
+ * fewer calls. The bytes past the break stay out of bounds to mem_in_heap
+ * and (in ASan builds) poisoned, but don't fault. Call this before
+ * mem_init.
+ *
+ * @param[in] size The granule in bytes, rounded up to a power of two times
+ *                 the page size; 0 for one page
+ */
+void mem_set_sbrk_granule(size_t size);
+
+/**
+ * @brief Returns the granule in which mem_sbrk makes the heap accessible.
+ * @return The granule, in bytes
+ */
+size_t mem_sbrk_granule(void);
+
+/**
+ * @brief System calls memlib has made on the allocator's behalf.
+ */
+typedef struct {
+    size_t mprotect; /**< by mem_sbrk, growing or shrinking the heap */
+    size_t madvise;  /**< by mem_sbrk, shrinking the heap */
+    size_t mmap;     /**< by mem_map */
+    size_t munmap;   /**< by mem_unmap */
+} mem_syscalls_t;
+
+/**
+ * @brief Returns the system calls made since the last reset.
+ *
+ * The calls mem_reset_brk itself makes are not counted. Sparse mode makes
+ * none.
+ *
+ * @return The number of calls of each kind
+ */
+mem_syscalls_t mem_syscalls(void);
+
+/**
+ * @brief Returns the kind of pages that back the heap.
+ *
+ * If the pages asked for could not be had, mem_init falls back to smaller
+ * ones, with a warning: explicit huge pages to transparent ones, and those
+ * to small pages.
+ *
+ * @return The kind of pages mem_init got
+ */
+mem_page_mode_t mem_page_mode(void);
+
 /**
  * @brief Finds the low address of the heap.
  * @return The address of the first valid byte in the heap.
@@ -63,14 +241,67 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the number of bytes in mapped regions.
+ * @return The total size of the regions, in bytes
+ */
+size_t mem_mapsize(void);
+
+/**
+ * @brief Returns the peak memory footprint since the last reset.
+ * @return The largest total size of all arenas (heap included) plus
+ *         mapped regions, in bytes
+ */
+size_t mem_peaksize(void);
+
+/**
+ * @brief Tells whether a range of bytes lies in the heap or in a region.
+ * @param[in] addr The first byte of the range
+ * @param[in] len  The length of the range
+ * @return true if the range is within one arena (such as the heap) or
+ *         within one mapped region
+ */
+bool mem_in_heap(const void *addr, size_t len);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
  */
 size_t mem_pagesize(void);
 
+/**
+ * @brief Returns the number of calls to mem_sbrk since the last reset.
+ * @return The call count, including calls that failed and calls to
+ *         mem_arena_sbrk
+ */
+size_t mem_sbrk_calls(void);
+
+/**
+ * @brief Tells whether new memory from mem_sbrk and mem_map reads as zero.
+ *
+ * Allocators can use this to avoid clearing memory that has never been
+ * written, e.g. in calloc. mem_arena_sbrk behaves like mem_sbrk.
+ *
+ * @return true if every byte returned by mem_sbrk or mem_map is zero
+ */
+bool mem_sbrk_zeroed(void);
+
 /* Functions used for memory emulation */
 
+/**
+ * @brief Counts of emulated page lookups, in sparse mode.
+ */
+typedef struct {
+    size_t hits;   /**< Found among the pages used most recently */
+    size_t misses; /**< Searched for in the page table */
+} mem_tlb_stats_t;
+
+/**
+ * @brief Returns the emulated page lookups since mem_init.
+ * @return The counts, all zero in dense mode
+ */
+mem_tlb_stats_t mem_tlb_stats(void);
+
 /**
  * @brief Performs a simulated memory read at an address.
  * @param[in] addr Simulated memory address to read from
@@ -105,6 +336,10 @@ void mem_write128(void *addr, __int128_t val);
 
 /**
  * @brief Emulation of memcpy
+ *
+ * On a dense heap, this is libc's memcpy. Sparse emulation copies a page
+ * span at a time, between the emulated pages.
+ *
  * @param[in] dst
  * @param[in] src
  * @param[in] n
@@ -114,6 +349,9 @@ void *mem_memcpy(void *dst, const void *src, size_t n);
 
 /**
  * @brief Emulation of memset
+ *
+ * On a dense heap, this is libc's memset; see mem_memcpy.
+ *
  * @param[in] dst
  * @param[in] c
  * @param[in] n
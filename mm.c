@@ -14,20 +14,120 @@
  * Alloc blocks: consist of header and payload (no footer)
  *
  *
+ * Segregated free lists: indexed TLSF-style with two levels. The first level
+ *splits sizes into power-of-two ranges, the second level splits each range
+ *into SL_INDEX_COUNT linear sub-ranges. A bitmap per level records which
+ *lists are non-empty, so the first non-empty class that fits is found with a
+ *bit scan instead of walking lists. The index (list heads plus bitmaps) is
+ *stored at the very start of the heap, so the global data stays small. The
+ *first level stops at tree_min_size, which keeps the index to a few hundred
+ *bytes of the heap.
+ *
+ * Large free blocks (tree_min_size bytes and up) are not in the lists but in
+ *a red-black tree ordered by size, then address, built from pointers inside
+ *the free blocks themselves.
+ *
  * Find fit function:
- * -> Consists of finding first valid fit, and then looks at a maximum of 20
- *blocks in the corresponding segmented list that come after the first fit, to
- *see if any of them have a size closer to the requested one by malloc
+ * -> Sizes that go in the tree get its exact best fit, in O(log n)
+ * -> Otherwise looks in the class of the requested size first: looks at a
+ *maximum of 21 blocks of that class, and keeps the one whose size is closest
+ *to the one requested by malloc
+ * -> Otherwise takes the head of the next non-empty class, found with the
+ *bitmaps in constant time (every block in a larger class fits), or the
+ *smallest block in the tree
+ *
+ * Realloc: resizes in place whenever it can, copying only as a last resort
+ * -> Shrinking splits the tail off as a free block
+ * -> Growing absorbs the next block if it is free and big enough
+ * -> If the block is the last one in the heap (possibly followed by a free
+ *block), the heap is extended right behind it
+ *
+ * Slabs: requests of up to slab_max_size bytes don't get blocks of their own.
+ *Each small size class (16, 32, ..., 128 bytes) has runs: run_size-aligned
+ *pieces of run_size bytes that start with a slab_run_t header (class,
+ *occupancy bitmap, list links), followed by headerless objects. Runs are
+ *not in the heap but in an arena of their own (the slab arena), which only
+ *ever holds runs, so free knows a slab object by its address alone and
+ *finds its run by rounding the pointer down to run_size. Runs with free
+ *slots are on a per-class list in the index, in address order, and objects
+ *come from the first one; a run that empties is given back unless it is
+ *its class's last one. New runs reuse an empty one or extend the slab
+ *arena, and empty runs at its top shrink it.
+ *Only requests that would get a bigger block of their own use runs (the
+ *others, with up to wsize bytes past a multiple of dsize, get a block of
+ *the object size and the quick lists make those fast), and a class only
+ *gets runs once half a run's worth of its requests are live in ordinary
+ *blocks: a run costs run_size bytes however few objects it holds.
+ *
+ * Quick lists: freed blocks of quick_min_size to quick_max_size bytes are
+ *not coalesced right away. They stay marked alloced on a LIFO list of
+ *their exact size and go straight back out on the next malloc of that size.
+ *A list is flushed (its blocks freed and coalesced for real) when it grows
+ *past quick_list_limit blocks (or quick_list_bytes of small blocks), and
+ *all of them are flushed before extending the heap.
+ *
+ * Heap extension: when nothing fits, a free block at the end of the heap
+ *already covers part of the request, so mem_sbrk is only asked for the
+ *shortfall (at least the current chunk) and the new memory coalesces with
+ *it. The chunk grows geometrically, from chunksize up to chunk_max_size
+ *and at most 1/32 of the heap, while extensions come in quick succession,
+ *and shrinks back once they become rare
+ *
+ * Heap trimming: when free leaves a free block of at least trim_threshold
+ *bytes (and two chunks) at the end of the heap, the heap shrinks with a
+ *negative mem_sbrk down to one chunk of free space
+ *
+ * Regions: requests of region_min_size bytes and up don't go in the heap at
+ *all. Each gets a region of its own from mem_map, holding just its header
+ *and payload; free unmaps it right away, so a large block never leaves a
+ *hole in the heap. free tells region payloads apart by their address,
+ *which is outside the heap.
+ *
+ * Calloc: memory fresh from mem_sbrk is already zero, so the allocator keeps
+ *track of where the never-written memory at the end of the heap starts
+ *(zero_start) and calloc only clears the bytes below it
+ *
+ * Arenas: the heap is a memlib arena (mem_arena_t, the default one for
+ *now), and everything the allocator knows about it, from the free lists
+ *to heap_start and zero_start, is in the index at its start. So are the
+ *slab arena and the bounds of its reserved space. The only global that
+ *refers to the heap is the pointer to that index
+ *
+ * Thread safety: built with USE_THREADS (mm-native-mt.o), the allocator takes
+ *locks around its shared state. The lists, tree and block headers of the
+ *heap share one heap lock, since coalescing touches the neighbours of a
+ *block whatever their class. Each slab class and each quick list has a lock
+ *of its own, so small requests of different sizes don't contend, and the
+ *calls into memlib have the sbrk lock. Locks are always taken in the order
+ *slab -> heap -> quick -> sbrk
+ *
+ * Thread caches: in the same build, each thread that mallocs keeps a cache
+ *of slab objects and quick list blocks, one bin per class, that malloc and
+ *free use without any lock. An empty bin is refilled with a batch from the
+ *shared runs or quick list, and a bin past its high-water mark (as many
+ *objects as fit in tcache_bin_bytes, at most tcache_bin_limit) sends half
+ *of them back, each under one lock. A thread's cache goes back when it
+ *exits
+ *
+ * Remote frees: a thread with no cache (one that only frees, like the
+ *consumer of a producer/consumer pair) doesn't take the class lock either.
+ *It pushes the object on its class's remote-free stack with a compare and
+ *swap, and the next malloc of that class takes the whole stack into its
+ *thread cache at once
  *
  * Design choices made throughout the process
  *
  * 1. Removed footers on alloc blocks, improving util.
  *
- * 2. Mini blocks: I immplement it on a singly linked list, whose start is
- *stored in the variable block_t *mini_list_start
+ * 2. Mini blocks: they are kept in the index class of size 16, on a doubly
+ *linked list like every other class
  *  -> If alloc: consist of header (8 bytes) and payload (8 bytes)
  *  -> If free: consist of header (8 bytes) and pointer to next mini block (8
- *bytes)
+ *bytes). There is no room for a prev pointer, so the header stores it
+ *instead: the payload address of the previous free mini block is 16-byte
+ *aligned, so it goes in the size bits and bit 3 (mini_free_mask) says the
+ *size bits hold a pointer and the size is 16. This makes unlinking a mini
+ *block O(1) when coalescing with it.
  *
  *************************************************************************
  *
@@ -51,6 +151,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
@@ -104,6 +208,11 @@
 #define dbg_printheap(...) ((void)((0) && print_heap(__VA_ARGS__)))
 #endif
 
+#if defined(USE_THREADS) && defined(DEBUG)
+/* The contract checks call mm_checkheap while holding the allocator's locks */
+#error "The thread-safe build does not support DEBUG"
+#endif
+
 /* Basic constants */
 
 typedef uint64_t word_t;
@@ -119,17 +228,39 @@ static const size_t dsize = 2 * wsize; // dsize = 16 bytes
  */
 static const size_t min_block_size = dsize; // update to 16 bytes
 /**
+ * @brief Smallest amount to extend the heap by (bytes)
  *
  * (Must be divisible by dsize)
  */
 static const size_t chunksize = (1 << 12);
 
+/** @brief Largest amount to extend the heap by (bytes, divisible by dsize) */
+static const size_t chunk_max_size = (1 << 20);
+
+/** @brief Extensions are at most 1/2^chunk_heap_shift of the heap size */
+static const size_t chunk_heap_shift = 5;
+
+/**
+ * @brief The chunk doubles if the heap grows again within this many heap
+ *        allocations
+ */
+static const size_t grow_burst_allocs = 256;
+
+/** @brief The chunk halves if the heap grew this many allocations ago */
+static const size_t grow_idle_allocs = 4096;
+
+/** @brief A free block at the end of the heap is trimmed from this size on */
+static const size_t trim_threshold = (1 << 18);
+
 static const word_t alloc_mask = 0x1;
 // added
 static const word_t prev_alloc_mask = 0x2;
 
 static const word_t prev_mini_mask = 0x4;
 
+/** @brief Set in the header of a free mini block that is in the free list */
+static const word_t mini_free_mask = 0x8;
+
 static const word_t size_mask = ~(word_t)0xF;
 
 /** @brief Represents the header and payload of one block in the heap */
@@ -141,34 +272,218 @@ typedef struct block {
             struct block *next_free;
             struct block *prev_free;
         };
+        /* free blocks of at least tree_min_size are tree nodes instead */
+        struct {
+            struct block *tree_left;
+            struct block *tree_right;
+            struct block *tree_parent;
+            word_t tree_red;
+        };
 
         char payload[0];
     };
 } block_t;
 
 // MACROS
-#define SEG_LIST_LEN 10
-#define FIRST_GROUP_SIZE 16
-#define SECOND_GROUP_SIZE 32
-#define THIRD_GROUP_SIZE 64
-#define FOURTH_GROUP_SIZE 128
-#define FIFTH_GROUP_SIZE 256
-#define SIXTH_GROUP_SIZE 512
-#define SEVENTH_GROUP_SIZE 1024
-#define EIGHTTH_GROUP_SIZE 2048
-#define NINTH_GROUP_SIZE 4096
-#define TENTH_GROUP_SIZE 8192
+/* log2 of the number of second-level lists per first-level range */
+#define SL_INDEX_LOG2 2
+#define SL_INDEX_COUNT (1 << SL_INDEX_LOG2)
+/* log2 of the alignment: block sizes are multiples of 16 bytes */
+#define ALIGN_LOG2 4
+/* Sizes below 1 << FL_INDEX_SHIFT all share first-level range 0 */
+#define FL_INDEX_SHIFT (SL_INDEX_LOG2 + ALIGN_LOG2)
+/* log2 of tree_min_size: larger free blocks are never in the lists */
+#define TREE_MIN_LOG2 12
+/* One first-level range per power of two below tree_min_size */
+#define FL_INDEX_COUNT (TREE_MIN_LOG2 - FL_INDEX_SHIFT + 1)
+
+/** @brief Sizes below this are mapped linearly into first-level range 0 */
+static const size_t small_block_size = (size_t)1 << FL_INDEX_SHIFT;
+
+/**
+ * @brief Free blocks of at least this size (bytes) go in the size-ordered
+ *        tree instead of the segregated lists. Any multiple of dsize big
+ *        enough to hold a tree node works
+ */
+static const size_t tree_min_size = (1 << TREE_MIN_LOG2);
+
+/**
+ * @brief Number of extra blocks looked at after the first fit in a class
+ *        before settling for the best one seen
+ */
+static const size_t fit_search_limit = 20;
+
+/**
+ * @brief Requests of at least this many bytes get a region of their own,
+ *        mapped with mem_map instead of being placed in the heap
+ */
+static const size_t region_min_size = (1 << 18);
+
+/* Number of slab size classes: 16, 32, ..., 128 bytes */
+#define SLAB_CLASS_COUNT 8
+/* Words in a run's occupancy bitmap (enough for 4096 / 16 objects) */
+#define RUN_BITMAP_WORDS 4
+
+/** @brief Largest request served from slab runs (bytes) */
+static const size_t slab_max_size = SLAB_CLASS_COUNT * dsize;
+
+/**
+ * @brief Size of a run (bytes). Runs are aligned to it, so it must be a
+ *        power of two that divides the page size
+ */
+static const size_t run_size = (1 << 12);
+
+/**
+ * @brief Bytes reserved for slab runs: the size of the arena they are in.
+ *        Once it is full, small requests get ordinary blocks
+ */
+static const size_t slab_arena_size = (1 << 24);
+
+/**
+ * @brief A slab class gets runs once 1/slab_open_div of a run's worth of
+ *        its requests are live in ordinary blocks
+ */
+static const size_t slab_open_div = 2;
+
+/**
+ * @brief Header at the start of a slab run.
+ *
+ * Bit i of bitmap is set iff object i is alloced (bits past the run's
+ * capacity are always set). The objects follow the header. An empty run
+ * kept for later has slab_class SLAB_CLASS_COUNT and is on the list of
+ * free runs instead.
+ */
+typedef struct slab_run {
+    struct slab_run *next_run;
+    struct slab_run *prev_run;
+    uint32_t slab_class;
+    uint32_t used; // number of alloced objects
+    word_t bitmap[RUN_BITMAP_WORDS];
+    _Alignas(2 * sizeof(word_t)) char objects[0];
+} slab_run_t;
+
+/* Number of quick lists: one per block size from 16 to 512 bytes */
+#define QUICK_CLASS_COUNT 32
+
+/** @brief Smallest block size kept on quick lists (bytes) */
+static const size_t quick_min_size = min_block_size;
+
+/** @brief Largest block size kept on quick lists (bytes) */
+static const size_t quick_max_size =
+    min_block_size + (QUICK_CLASS_COUNT - 1) * dsize;
+
+/**
+ * @brief Blocks a quick list may hold before it is flushed, or as many as
+ *        fit in quick_list_bytes if that is more
+ */
+static const size_t quick_list_limit = 32;
+
+/** @brief Bytes of blocks a quick list of small blocks may hold */
+static const size_t quick_list_bytes = (1 << 12);
+
+/* Number of small classes (thread cache bins): slab, then quick classes */
+#define TCACHE_BIN_COUNT (SLAB_CLASS_COUNT + QUICK_CLASS_COUNT)
+
+/**
+ * @brief Two-level segregated free-list index.
+ *
+ * heads[fl][sl] is the start of the doubly linked free list for class
+ * (fl, sl). Bit fl of fl_bitmap is set iff sl_bitmap[fl] is non-zero, and
+ * bit sl of sl_bitmap[fl] is set iff heads[fl][sl] is non-empty.
+ * slab_runs[c] lists the runs of slab class c that have a free object.
+ * The runs are not in the heap but in an arena of their own, slab_arena,
+ * whose reserved space spans slab_lo to slab_end; free_runs lists its empty
+ * runs below the top one.
+ * slab_demand[c] counts the live requests of class c in ordinary blocks,
+ * until the class gets runs and bit c of slab_open is set (see
+ * slab_opened).
+ * quick[q] is a LIFO list (through next_free) of quick_count[q] freed blocks
+ * of size quick_min_size + q * dsize that have not been coalesced yet.
+ * remote[b] is a stack of small objects of class b (numbered like thread
+ * cache bins) freed by threads without a cache, still marked alloced.
+ *
+ * Every byte from zero_start up to the footer of the last block has never
+ * been written since mem_sbrk.
+ *
+ * The index lives in the first bytes of the heap (see mm_init), and binds
+ * the allocator to the arena the heap is in: nothing else in the file
+ * describes the heap.
+ */
+typedef struct {
+    mem_arena_t *arena;  // the memlib arena the heap is in
+    block_t *heap_start; // first block in the heap, NULL until it is set up
+    char *zero_start;    // start of the known-zero memory, see below
+    word_t fl_bitmap;
+    uint8_t sl_bitmap[FL_INDEX_COUNT];
+    block_t *heads[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    mem_arena_t *slab_arena; // the arena of the runs, NULL if none
+    char *slab_lo;           // first byte of the runs' reserved space
+    char *slab_end;          // end of the runs' reserved space
+    slab_run_t *free_runs;   // empty runs in the arena, under the heap lock
+    slab_run_t *slab_runs[SLAB_CLASS_COUNT]; // runs with free slots
+    uint32_t slab_demand[SLAB_CLASS_COUNT];  // live requests before runs
+    word_t slab_open; // bit c is set once slab class c has runs
+    block_t *quick[QUICK_CLASS_COUNT];       // freed, still marked alloced
+    uint16_t quick_count[QUICK_CLASS_COUNT];
+    block_t *tree_root;  // free blocks of at least tree_min_size
+    size_t chunk;        // current heap growth step, see grow_size
+    size_t alloc_count;  // blocks alloced from the heap so far
+    size_t grow_alloc;   // alloc_count at the last heap extension
+#ifdef USE_THREADS
+    pthread_mutex_t heap_lock; // the blocks in the heap and everything above
+    pthread_mutex_t sbrk_lock; // memlib (mem_sbrk, mem_map, mem_unmap)
+    pthread_mutex_t slab_locks[SLAB_CLASS_COUNT];   // slab_runs[c], its runs
+    pthread_mutex_t quick_locks[QUICK_CLASS_COUNT]; // quick[q], quick_count[q]
+    void *remote[TCACHE_BIN_COUNT]; // lock-free stacks, see push_remote
+#endif
+} seg_index_t;
+
+#ifdef USE_THREADS
+/** @brief Most bytes of objects a thread cache bin holds */
+static const size_t tcache_bin_bytes = (1 << 12);
+
+/** @brief Most objects a thread cache bin holds, whatever their size */
+static const size_t tcache_bin_limit = 64;
+
+/**
+ * @brief A thread's cache of small objects (thread-safe builds only).
+ *
+ * head[b] is a LIFO list, through the first word of each payload, of
+ * count[b] objects that are still marked alloced in their run or quick
+ * list size: bin b < SLAB_CLASS_COUNT holds objects of slab class b, and
+ * the others blocks of quick list b - SLAB_CLASS_COUNT (only lists of
+ * blocks over slab_max_size bytes have a bin in use). The cache itself is
+ * an alloced block in the heap.
+ */
+typedef struct {
+    void *head[TCACHE_BIN_COUNT];
+    uint32_t count[TCACHE_BIN_COUNT];
+} tcache_t;
+#endif
 
 /* Global variables */
 
-/** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
+/**
+ * @brief Pointer to the segregated free-list index, which holds all the
+ *        allocator's state (stored at the start of its arena)
+ */
+static seg_index_t *seg_index = NULL;
+
+#ifdef USE_THREADS
+/** @brief Serializes the lazy mm_init in malloc and calloc */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/** @brief Pointer to segmented free-list list */
-static block_t *segment_list[SEG_LIST_LEN];
+/** @brief Number of times mm_init has run: caches of older heaps are gone */
+static size_t heap_epoch = 0;
 
-/** @brief Pointer to mini block free-list list */
-static block_t *mini_list_start = NULL;
+/** @brief Frees the calling thread's cache when it exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/** @brief The calling thread's cache, valid if tcache_epoch == heap_epoch */
+static _Thread_local tcache_t *tcache = NULL;
+static _Thread_local size_t tcache_epoch = 0;
+#endif
 
 /*
  *****************************************************************************
@@ -245,13 +560,14 @@ static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_mini) {
  * @brief Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. Free mini blocks keep a pointer in the size bits
+ * instead (see mini_free_mask), their size is always min_block_size.
  *
  * @param[in] word
  * @return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
-    return (word & size_mask);
+    return (word & mini_free_mask) ? min_block_size : (word & size_mask);
 }
 
 /**
@@ -405,7 +721,7 @@ static bool get_prev_mini(block_t *block) {
  */
 static void write_epilogue(block_t *block, bool is_prev_mini) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == (char *)mem_heap_hi() - 7);
+    dbg_requires((char *)block == (char *)mem_arena_hi(seg_index->arena) - 7);
     block->header = pack(0, true, false, is_prev_mini); // add mini blocks
 }
 
@@ -457,6 +773,22 @@ static block_t *find_prev(block_t *block) {
     return footer_to_header(footerp);
 }
 
+/**
+ * @brief Updates the prev_alloc and prev_mini bits of a block's header.
+ *
+ * Only those two bits change, so this is safe on a free mini block whose
+ * header also holds its prev pointer.
+ *
+ * @param[out] block The block whose header is updated
+ * @param[in] prev_alloc The allocation status of the previous block
+ * @param[in] prev_mini Whether the previous block is a mini block
+ */
+static void write_prev_status(block_t *block, bool prev_alloc,
+                              bool prev_mini) {
+    word_t word = block->header & ~(prev_alloc_mask | prev_mini_mask);
+    block->header = word | pack(0, false, prev_alloc, prev_mini);
+}
+
 /**
  * @brief Writes a mini block starting at the given address.
  *
@@ -474,15 +806,7 @@ static void write_miniblock(block_t *block, size_t size, bool alloc,
 
     // Step 2: Edit next block's prev_alloc bit
     block_t *next_block = find_next(block);
-    bool is_next_alloc = get_alloc(next_block);
-    size_t next_size = get_size(next_block);
-
-    // If next block alloc: only edit header
-    if (is_next_alloc) {
-        next_block->header = pack(next_size, is_next_alloc, alloc, true);
-    } else { // If next block free: edit header and footer
-        next_block->header = pack(next_size, is_next_alloc, alloc, true);
-    }
+    write_prev_status(next_block, alloc, true);
 }
 
 /**
@@ -518,15 +842,7 @@ static void write_block(block_t *block, size_t size, bool alloc,
 
         // Step 2: Edit next block's prev_alloc bit
         block_t *next_block = find_next(block);
-        bool is_next_alloc = get_alloc(next_block);
-        size_t next_size = get_size(next_block);
-
-        // If next block alloc: only edit header
-        if (is_next_alloc) {
-            next_block->header = pack(next_size, is_next_alloc, alloc, false);
-        } else { // If next block free: edit header and footer
-            next_block->header = pack(next_size, is_next_alloc, alloc, false);
-        }
+        write_prev_status(next_block, alloc, false);
     }
 
     //@poscondition
@@ -542,215 +858,710 @@ static void write_block(block_t *block, size_t size, bool alloc,
 /******** The remaining content below are helper and debug routines ********/
 
 /**
- * @brief
- *
- * Checks block is not
- * @param[in] block
+ * @brief Binds the allocator to the state in an index (NULL for none).
+ * @param[in] index
+ */
+static void set_seg_index(seg_index_t *index) {
+#ifdef USE_THREADS
+    __atomic_store_n(&seg_index, index, __ATOMIC_RELEASE);
+#else
+    seg_index = index;
+#endif
+}
+
+/**
+ * @brief Tells whether mm_init has set up the heap.
  * @return
  */
-static bool not_in_free_list(block_t *input_block) {
-    // loop through each free list
-    for (size_t i = 0; i < SEG_LIST_LEN; i++) {
-        block_t *seg_free_list_start = segment_list[i];
-        // ensure block not in list
-        for (block_t *block = seg_free_list_start; block != NULL;
-             block = block->next_free) {
-            if (input_block == block)
-                return false;
-        }
-    }
+static bool heap_ready(void) {
+#ifdef USE_THREADS
+    seg_index_t *index = __atomic_load_n(&seg_index, __ATOMIC_ACQUIRE);
+    return index != NULL &&
+           __atomic_load_n(&index->heap_start, __ATOMIC_ACQUIRE) != NULL;
+#else
+    return seg_index != NULL && seg_index->heap_start != NULL;
+#endif
+}
 
-    // otherwise
-    return true;
+/*
+ * Locks (thread-safe builds only, no-ops otherwise). Locks are always taken
+ * in this order, and a thread never waits for a lock earlier in the order
+ * than one it holds:
+ *   1. slab_locks[c]  - at most one at a time (the checker takes all, by c)
+ *   2. heap_lock
+ *   3. quick_locks[q] - at most one at a time
+ *   4. sbrk_lock
+ * The heap lock also covers the slab arena's list of free runs and the
+ * classes of its runs, which release_run looks at.
+ * So a slab class may extend into the heap, the heap may drain quick lists
+ * and call memlib, but a quick list or memlib call never waits on the heap.
+ * free and realloc read the header of their own block with no lock held: its
+ * size and alloc bits stay put while it is alloced, only the prev bits that
+ * its neighbours update (under the heap lock) change.
+ */
+
+/** @brief Takes the lock for the blocks in the heap */
+static void lock_heap(void) {
+#ifdef USE_THREADS
+    pthread_mutex_lock(&seg_index->heap_lock);
+#endif
+}
+
+/** @brief Releases the lock for the blocks in the heap */
+static void unlock_heap(void) {
+#ifdef USE_THREADS
+    pthread_mutex_unlock(&seg_index->heap_lock);
+#endif
+}
+
+/** @brief Takes the lock for calls into memlib */
+static void lock_sbrk(void) {
+#ifdef USE_THREADS
+    pthread_mutex_lock(&seg_index->sbrk_lock);
+#endif
+}
+
+/** @brief Releases the lock for calls into memlib */
+static void unlock_sbrk(void) {
+#ifdef USE_THREADS
+    pthread_mutex_unlock(&seg_index->sbrk_lock);
+#endif
+}
+
+/**
+ * @brief Takes the lock of slab class c.
+ * @param[in] c
+ */
+static void lock_slab(size_t c) {
+#ifdef USE_THREADS
+    pthread_mutex_lock(&seg_index->slab_locks[c]);
+#endif
+}
+
+/**
+ * @brief Releases the lock of slab class c.
+ * @param[in] c
+ */
+static void unlock_slab(size_t c) {
+#ifdef USE_THREADS
+    pthread_mutex_unlock(&seg_index->slab_locks[c]);
+#endif
+}
+
+/**
+ * @brief Takes the lock of quick list q.
+ * @param[in] q
+ */
+static void lock_quick(size_t q) {
+#ifdef USE_THREADS
+    pthread_mutex_lock(&seg_index->quick_locks[q]);
+#endif
+}
+
+/**
+ * @brief Releases the lock of quick list q.
+ * @param[in] q
+ */
+static void unlock_quick(size_t q) {
+#ifdef USE_THREADS
+    pthread_mutex_unlock(&seg_index->quick_locks[q]);
+#endif
+}
+
+/** @brief Sets up the locks in a new index */
+static void init_locks(void) {
+#ifdef USE_THREADS
+    pthread_mutex_init(&seg_index->heap_lock, NULL);
+    pthread_mutex_init(&seg_index->sbrk_lock, NULL);
+    for (size_t c = 0; c < SLAB_CLASS_COUNT; c++) {
+        pthread_mutex_init(&seg_index->slab_locks[c], NULL);
+    }
+    for (size_t q = 0; q < QUICK_CLASS_COUNT; q++) {
+        pthread_mutex_init(&seg_index->quick_locks[q], NULL);
+    }
+#endif
 }
 
+#ifdef USE_THREADS
 /**
  * @brief
  *
- * Returns seg list index depending on size
+ * Pushes a freed small object on a remote-free stack, with a compare and
+ * swap instead of a lock. The link goes in the first word of the payload
+ * (next_free, for quick list blocks)
  *
- * @param[in] Size
- * @return
+ * @param[in] b  The object's class
+ * @param[in] bp
  */
-static size_t determine_seg_index(size_t size) {
-    if (size <= FIRST_GROUP_SIZE)
-        return 0;
-    else if (size <= SECOND_GROUP_SIZE)
-        return 1;
-    else if (size <= THIRD_GROUP_SIZE)
-        return 2;
-    else if (size <= FOURTH_GROUP_SIZE)
-        return 3;
-    else if (size <= FIFTH_GROUP_SIZE)
-        return 4;
-    else if (size <= SIXTH_GROUP_SIZE)
-        return 5;
-    else if (size <= SEVENTH_GROUP_SIZE)
-        return 6;
-    else if (size <= EIGHTTH_GROUP_SIZE)
-        return 7;
-    else if (size <= NINTH_GROUP_SIZE)
-        return 8;
-    else
-        return 9;
-
-    // otherwise raise fail
-    dbg_assert(1 == 0);
+static void push_remote(size_t b, void *bp) {
+    void *head = __atomic_load_n(&seg_index->remote[b], __ATOMIC_RELAXED);
+    do {
+        *(void **)bp = head;
+    } while (!__atomic_compare_exchange_n(&seg_index->remote[b], &head, bp,
+                                          true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
 }
+#endif
 
 /**
  * @brief
  *
- * Adds block to start of mini free list (LIFO)
- * @param[in] block
- * @return
+ * Empties a remote-free stack. Taking the whole stack at once, rather than
+ * popping objects, leaves no room for ABA
+ *
+ * @param[in] b
+ * @return The objects, linked through their first word (always NULL in
+ *         single-threaded builds)
  */
-static void add_to_mini_free_list(block_t *block) {
-    dbg_printf("\n Added to mini free list\n");
-    // edge case: free list is NULL, empty
-    if (mini_list_start == NULL) {
-        mini_list_start = block;
-        block->next_free = NULL;
+static void *take_remote(size_t b) {
+#ifdef USE_THREADS
+    if (__atomic_load_n(&seg_index->remote[b], __ATOMIC_RELAXED) == NULL) {
+        return NULL;
     }
-    // general case
-    else {
-        block->next_free = mini_list_start;
-        mini_list_start = block;
+    return __atomic_exchange_n(&seg_index->remote[b], NULL, __ATOMIC_ACQUIRE);
+#else
+    (void)b;
+    return NULL;
+#endif
+}
 
-        dbg_assert(block->next_free != block);
-    }
+/**
+ * @brief Returns the position of the most significant set bit of x
+ * @param[in] x Must be non-zero
+ */
+static size_t find_msb(size_t x) {
+    dbg_requires(x != 0);
+    return (size_t)(63 - __builtin_clzl(x));
+}
+
+/**
+ * @brief Returns the position of the least significant set bit of x
+ * @param[in] x Must be non-zero
+ */
+static size_t find_lsb(size_t x) {
+    dbg_requires(x != 0);
+    return (size_t)__builtin_ctzl(x);
 }
 
 /**
  * @brief
  *
- * Adds block to start of free list (LIFO)
- * @param[in] block
- * @return
+ * Computes the segregated class (first-level and second-level index) that a
+ * free block of the given size belongs to.
+ *
+ * Sizes below small_block_size are split linearly in 16-byte steps. Every
+ * larger power-of-two range [2^k, 2^(k+1)) is split into SL_INDEX_COUNT
+ * equal sub-ranges.
+ *
+ * @param[in] size
+ * @param[out] fl First-level index
+ * @param[out] sl Second-level index
  */
-static void add_to_free_list(block_t *block) {
-    dbg_requires(not_in_free_list(block));
-    dbg_requires(!get_alloc(block));
-
-    size_t size = get_size(block);
-
-    // check if miniblock
-    if (size == min_block_size) {
-        add_to_mini_free_list(block);
+static void determine_seg_class(size_t size, size_t *fl, size_t *sl) {
+    dbg_requires(size >= min_block_size);
+
+    if (size < small_block_size) {
+        *fl = 0;
+        *sl = size >> ALIGN_LOG2;
+    } else {
+        size_t msb = find_msb(size);
+        *fl = msb - FL_INDEX_SHIFT + 1;
+        *sl = (size >> (msb - SL_INDEX_LOG2)) ^ SL_INDEX_COUNT;
     }
 
-    else { // General case (works)
-        // Determine seg list that block belongs to
-        size_t index = determine_seg_index(size);
+    dbg_ensures(*fl < FL_INDEX_COUNT && *sl < SL_INDEX_COUNT);
+}
 
-        // edge case: free list is NULL, empty
-        if (segment_list[index] == NULL) {
-            segment_list[index] = block;
-            block->prev_free = NULL;
-            block->next_free = NULL;
-        }
-        // general case
-        else {
-            block->next_free = segment_list[index];
-            segment_list[index]->prev_free = block;
-            block->prev_free = NULL;
-            segment_list[index] = block;
-
-            dbg_assert(block->next_free != block);
+/**
+ * @brief Returns the previous block in a free block's list.
+ *
+ * Free mini blocks have no prev_free field: the payload address of their
+ * prev block is kept in the size bits of the header (see mini_free_mask).
+ *
+ * @param[in] block A block in a free list
+ * @return The previous block in the list, or NULL if block is the head
+ */
+static block_t *get_prev_free(block_t *block) {
+    if (block->header & mini_free_mask) {
+        word_t prev_payload = block->header & size_mask;
+        if (prev_payload == 0) {
+            return NULL;
         }
+        return payload_to_header((void *)(uintptr_t)prev_payload);
+    }
+    return block->prev_free;
+}
+
+/**
+ * @brief Sets the previous block in a free block's list.
+ *
+ * For a mini block this also tags the header with mini_free_mask, which
+ * stays set until the block is removed from the list.
+ *
+ * @param[out] block A free block being linked into a list
+ * @param[in] prev The previous block in the list, or NULL
+ */
+static void set_prev_free(block_t *block, block_t *prev) {
+    if (get_size(block) == min_block_size) {
+        word_t prev_payload =
+            (prev == NULL) ? 0 : (word_t)(uintptr_t)header_to_payload(prev);
+        dbg_assert((prev_payload & ~size_mask) == 0);
+        word_t flags = block->header & (prev_alloc_mask | prev_mini_mask);
+        block->header = prev_payload | mini_free_mask | flags;
+    } else {
+        block->prev_free = prev;
     }
 }
 
 /**
  * @brief
  *
- * Removes block from mini free list
+ * Pushes block onto the start of the list of class (fl, sl) (LIFO) and marks
+ * the class as non-empty in the bitmaps
+ *
  * @param[in] block
- * @return
  */
-static void remove_from_mini_free_list(block_t *block) {
-    dbg_requires(block != NULL);
+static void push_seg_class(block_t *block, size_t fl, size_t sl) {
+    block_t *head = seg_index->heads[fl][sl];
+
+    block->next_free = head;
+    set_prev_free(block, NULL);
+    if (head != NULL) {
+        set_prev_free(head, block);
+    } else {
+        seg_index->sl_bitmap[fl] |= (uint8_t)(1u << sl);
+        seg_index->fl_bitmap |= (word_t)1 << fl;
+    }
+    seg_index->heads[fl][sl] = block;
 
-    block_t *current = mini_list_start;
-    block_t *prev = NULL;
+    dbg_assert(block->next_free != block);
+}
+
+/**
+ * @brief Orders tree nodes by size, then by address.
+ * @param[in] a
+ * @param[in] b
+ * @return true if a comes before b
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
 
-    // until we encounter node or end
-    while (current != NULL && current != block) {
-        prev = current;
-        current = current->next_free;
+/**
+ * @brief Puts v where u was as a child of u's parent (or as the root).
+ * @param[in] u
+ * @param[in] v May be NULL
+ */
+static void tree_transplant(block_t *u, block_t *v) {
+    block_t *parent = u->tree_parent;
+    if (parent == NULL) {
+        seg_index->tree_root = v;
+    } else if (parent->tree_left == u) {
+        parent->tree_left = v;
+    } else {
+        parent->tree_right = v;
     }
+    if (v != NULL) {
+        v->tree_parent = parent;
+    }
+}
 
-    if (current == NULL) {
-        dbg_assert(0);
-        return; // Node not found
+/**
+ * @brief Rotates x's right child up into x's place.
+ * @param[in] x
+ */
+static void tree_rotate_left(block_t *x) {
+    block_t *y = x->tree_right;
+    x->tree_right = y->tree_left;
+    if (y->tree_left != NULL) {
+        y->tree_left->tree_parent = x;
     }
+    tree_transplant(x, y);
+    y->tree_left = x;
+    x->tree_parent = y;
+}
 
-    if (prev == NULL) { // removed start of list
-        mini_list_start = current->next_free;
-    } else { // general case
-        prev->next_free = current->next_free;
+/**
+ * @brief Rotates x's left child up into x's place.
+ * @param[in] x
+ */
+static void tree_rotate_right(block_t *x) {
+    block_t *y = x->tree_left;
+    x->tree_left = y->tree_right;
+    if (y->tree_right != NULL) {
+        y->tree_right->tree_parent = x;
     }
+    tree_transplant(x, y);
+    y->tree_right = x;
+    x->tree_parent = y;
 }
 
 /**
- * @brief
- *
- * Removes block from free list
- * @param[in] block
+ * @brief Tells whether a node is red (missing leaves are black).
+ * @param[in] node May be NULL
  * @return
  */
-static void remove_from_free_list(block_t *block) {
-    dbg_requires(block != NULL);
-
-    size_t size = get_size(block);
+static bool tree_is_red(block_t *node) {
+    return node != NULL && node->tree_red;
+}
 
-    // check if miniblock
-    if (size == min_block_size) {
-        dbg_assert(mini_list_start != NULL);
-        remove_from_mini_free_list(block);
+/**
+ * @brief Finds the leftmost node of a subtree.
+ * @param[in] node
+ * @return
+ */
+static block_t *tree_minimum(block_t *node) {
+    while (node->tree_left != NULL) {
+        node = node->tree_left;
     }
+    return node;
+}
 
-    else { // General case (works)
-           // Determine seg list that block belongs to
-        size_t index = determine_seg_index(size);
-
-        // next and prev
-        block_t *next = block->next_free;
-        block_t *prev = block->prev_free;
+/**
+ * @brief Finds the node after a node in size order.
+ * @param[in] node
+ * @return The next node, or NULL if node is the last one
+ */
+static block_t *tree_next(block_t *node) {
+    if (node->tree_right != NULL) {
+        return tree_minimum(node->tree_right);
+    }
+    block_t *parent = node->tree_parent;
+    while (parent != NULL && node == parent->tree_right) {
+        node = parent;
+        parent = parent->tree_parent;
+    }
+    return parent;
+}
 
-        if (prev != NULL) {
-            prev->next_free = next;
+/**
+ * @brief
+ *
+ * Finds the best fit in the tree: the smallest block of at least asize
+ * bytes (the lowest one among equals)
+ *
+ * @param[in] asize
+ * @return The block, or NULL if no block in the tree is big enough
+ */
+static block_t *tree_best_fit(size_t asize) {
+    block_t *best = NULL;
+    block_t *node = seg_index->tree_root;
+    while (node != NULL) {
+        if (get_size(node) >= asize) {
+            best = node;
+            node = node->tree_left;
         } else {
-            // we need to find which segment list it is in
-            segment_list[index] = next;
+            node = node->tree_right;
         }
+    }
+    return best;
+}
 
-        if (next != NULL) {
-            next->prev_free = prev;
+/**
+ * @brief
+ *
+ * Inserts a free block in the red-black tree, then recolors and rotates
+ * until no red node has a red parent
+ *
+ * @param[in] block
+ */
+static void tree_insert(block_t *block) {
+    block_t *parent = NULL;
+    block_t **link = &seg_index->tree_root;
+    while (*link != NULL) {
+        parent = *link;
+        link = tree_less(block, parent) ? &parent->tree_left
+                                        : &parent->tree_right;
+    }
+    block->tree_parent = parent;
+    block->tree_left = NULL;
+    block->tree_right = NULL;
+    block->tree_red = true;
+    *link = block;
+
+    block_t *node = block;
+    while (tree_is_red(node->tree_parent)) {
+        parent = node->tree_parent;
+        block_t *grandparent = parent->tree_parent; // red nodes aren't root
+        if (parent == grandparent->tree_left) {
+            block_t *uncle = grandparent->tree_right;
+            if (tree_is_red(uncle)) {
+                parent->tree_red = false;
+                uncle->tree_red = false;
+                grandparent->tree_red = true;
+                node = grandparent;
+            } else {
+                if (node == parent->tree_right) {
+                    tree_rotate_left(parent);
+                    node = parent;
+                    parent = node->tree_parent;
+                }
+                parent->tree_red = false;
+                grandparent->tree_red = true;
+                tree_rotate_right(grandparent);
+            }
+        } else {
+            block_t *uncle = grandparent->tree_left;
+            if (tree_is_red(uncle)) {
+                parent->tree_red = false;
+                uncle->tree_red = false;
+                grandparent->tree_red = true;
+                node = grandparent;
+            } else {
+                if (node == parent->tree_left) {
+                    tree_rotate_right(parent);
+                    node = parent;
+                    parent = node->tree_parent;
+                }
+                parent->tree_red = false;
+                grandparent->tree_red = true;
+                tree_rotate_left(grandparent);
+            }
         }
-
-        // disconnect from doubly linked  list
-        block->next_free = NULL;
-        block->prev_free = NULL;
     }
+    seg_index->tree_root->tree_red = false;
 }
 
 /**
  * @brief
  *
- * Coalesces block into heap, avoiding separate adjacent
- * free blocks
+ * Removes a block from the red-black tree. If a black node is taken out,
+ * the subtree that lost it (rooted at node, possibly empty, under parent)
+ * is one black short, which is fixed by recoloring and rotating upwards
  *
  * @param[in] block
- * @return
  */
-static block_t *coalesce_block(block_t *block) {
-    // Determine which case of coalescing we must do
-
-    // @ requires
-    dbg_requires(block != NULL);
+static void tree_remove(block_t *block) {
+    block_t *node;
+    block_t *parent;
+    bool removed_red;
+
+    if (block->tree_left == NULL || block->tree_right == NULL) {
+        node = block->tree_left != NULL ? block->tree_left : block->tree_right;
+        parent = block->tree_parent;
+        removed_red = block->tree_red;
+        tree_transplant(block, node);
+    } else {
+        // Replace block by its successor, which has no left child
+        block_t *next = tree_minimum(block->tree_right);
+        removed_red = next->tree_red;
+        node = next->tree_right;
+        if (next->tree_parent == block) {
+            parent = next;
+        } else {
+            parent = next->tree_parent;
+            tree_transplant(next, node);
+            next->tree_right = block->tree_right;
+            next->tree_right->tree_parent = next;
+        }
+        tree_transplant(block, next);
+        next->tree_left = block->tree_left;
+        next->tree_left->tree_parent = next;
+        next->tree_red = block->tree_red;
+    }
 
-    // determine if next or prev blocks free or not
+    while (!removed_red && node != seg_index->tree_root &&
+           !tree_is_red(node)) {
+        if (node == parent->tree_left) {
+            block_t *sibling = parent->tree_right;
+            if (sibling->tree_red) {
+                sibling->tree_red = false;
+                parent->tree_red = true;
+                tree_rotate_left(parent);
+                sibling = parent->tree_right;
+            }
+            if (!tree_is_red(sibling->tree_left) &&
+                !tree_is_red(sibling->tree_right)) {
+                sibling->tree_red = true;
+                node = parent;
+                parent = node->tree_parent;
+            } else {
+                if (!tree_is_red(sibling->tree_right)) {
+                    sibling->tree_left->tree_red = false;
+                    sibling->tree_red = true;
+                    tree_rotate_right(sibling);
+                    sibling = parent->tree_right;
+                }
+                sibling->tree_red = parent->tree_red;
+                parent->tree_red = false;
+                sibling->tree_right->tree_red = false;
+                tree_rotate_left(parent);
+                node = seg_index->tree_root;
+            }
+        } else {
+            block_t *sibling = parent->tree_left;
+            if (sibling->tree_red) {
+                sibling->tree_red = false;
+                parent->tree_red = true;
+                tree_rotate_right(parent);
+                sibling = parent->tree_left;
+            }
+            if (!tree_is_red(sibling->tree_left) &&
+                !tree_is_red(sibling->tree_right)) {
+                sibling->tree_red = true;
+                node = parent;
+                parent = node->tree_parent;
+            } else {
+                if (!tree_is_red(sibling->tree_left)) {
+                    sibling->tree_right->tree_red = false;
+                    sibling->tree_red = true;
+                    tree_rotate_left(sibling);
+                    sibling = parent->tree_left;
+                }
+                sibling->tree_red = parent->tree_red;
+                parent->tree_red = false;
+                sibling->tree_left->tree_red = false;
+                tree_rotate_right(parent);
+                node = seg_index->tree_root;
+            }
+        }
+    }
+    if (node != NULL) {
+        node->tree_red = false;
+    }
+
+    block->tree_left = NULL;
+    block->tree_right = NULL;
+    block->tree_parent = NULL;
+}
+
+/**
+ * @brief
+ *
+ * Checks block is not
+ * @param[in] block
+ * @return
+ */
+static bool not_in_free_list(block_t *input_block) {
+    // loop through each free list
+    for (size_t fl = 0; fl < FL_INDEX_COUNT; fl++) {
+        for (size_t sl = 0; sl < SL_INDEX_COUNT; sl++) {
+            // ensure block not in list
+            for (block_t *block = seg_index->heads[fl][sl]; block != NULL;
+                 block = block->next_free) {
+                if (input_block == block)
+                    return false;
+            }
+        }
+    }
+
+    // nor in the tree
+    if (seg_index->tree_root != NULL) {
+        for (block_t *node = tree_minimum(seg_index->tree_root); node != NULL;
+             node = tree_next(node)) {
+            if (input_block == node)
+                return false;
+        }
+    }
+
+    // otherwise
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * Adds block to start of free list (LIFO)
+ * @param[in] block
+ * @return
+ */
+static void add_to_free_list(block_t *block) {
+    dbg_requires(not_in_free_list(block));
+    dbg_requires(!get_alloc(block));
+
+    size_t size = get_size(block);
+
+    // large blocks go in the tree
+    if (size >= tree_min_size) {
+        tree_insert(block);
+        return;
+    }
+
+    // check if miniblock
+    if (size == min_block_size) {
+        dbg_printf("\n Added to mini free list\n");
+    }
+
+    // Determine seg class that block belongs to
+    size_t fl, sl;
+    determine_seg_class(size, &fl, &sl);
+    push_seg_class(block, fl, sl);
+}
+
+/**
+ * @brief
+ *
+ * Removes block from free list. Takes constant time for every block size,
+ * mini blocks included.
+ *
+ * @param[in] block
+ * @return
+ */
+static void remove_from_free_list(block_t *block) {
+    dbg_requires(block != NULL);
+    dbg_requires(!get_alloc(block));
+
+    size_t size = get_size(block);
+
+    if (size >= tree_min_size) {
+        tree_remove(block);
+        return;
+    }
+
+    // next and prev
+    block_t *next = block->next_free;
+    block_t *prev = get_prev_free(block);
+
+    if (prev != NULL) {
+        prev->next_free = next;
+    } else {
+        // block was the head: find its class and update the bitmaps if
+        // the list becomes empty
+        size_t fl, sl;
+        determine_seg_class(size, &fl, &sl);
+        dbg_assert(seg_index->heads[fl][sl] == block);
+        seg_index->heads[fl][sl] = next;
+        if (next == NULL) {
+            seg_index->sl_bitmap[fl] &= (uint8_t) ~(1u << sl);
+            if (seg_index->sl_bitmap[fl] == 0) {
+                seg_index->fl_bitmap &= ~((word_t)1 << fl);
+            }
+        }
+    }
+
+    if (next != NULL) {
+        set_prev_free(next, prev);
+    }
+
+    // disconnect from doubly linked  list
+    block->next_free = NULL;
+    if (size == min_block_size) {
+        // drop the prev pointer, header is a plain free mini header again
+        block->header =
+            pack(size, false, get_prev_alloc(block), get_prev_mini(block));
+    } else {
+        block->prev_free = NULL;
+    }
+}
+
+/**
+ * @brief
+ *
+ * Coalesces block into heap, avoiding separate adjacent
+ * free blocks
+ *
+ * @param[in] block
+ * @return
+ */
+static block_t *coalesce_block(block_t *block) {
+    // Determine which case of coalescing we must do
+
+    // @ requires
+    dbg_requires(block != NULL);
+
+    // determine if next or prev blocks free or not
     block_t *coalesced_block = NULL;
 
     dbg_assert(block != NULL);
@@ -862,7 +1673,10 @@ static block_t *extend_heap(size_t size) {
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
+    lock_sbrk();
+    bp = mem_arena_sbrk(seg_index->arena, (intptr_t)size);
+    unlock_sbrk();
+    if (bp == (void *)-1) {
         return NULL;
     }
 
@@ -875,143 +1689,1398 @@ static block_t *extend_heap(size_t size) {
     block_t *block_next = find_next(block);
     write_epilogue(block_next, get_size(block) == min_block_size);
 
+    // The new memory is zero past the new block's header and free-block
+    // fields (list pointers or tree links, see block_t). If the
+    // known-zero memory reached the old trailing footer, it can simply grow
+    // once that footer and the old epilogue (stale words inside the
+    // coalesced block) are cleared
+    char *old_brk = (char *)bp;
+    char *old_zero_start = seg_index->zero_start;
+    seg_index->zero_start = (char *)block + sizeof(block_t);
+
     // Coalesce in case the previous block was free
     block = coalesce_block(block);
 
-    return block;
+    if (old_zero_start <= old_brk - dsize) {
+        memset(old_brk - dsize, 0, dsize);
+        seg_index->zero_start = old_zero_start;
+    }
+
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * Picks how much to extend the heap by to cover a shortfall of asize
+ * bytes. The chunk doubles while extensions come in bursts (less than
+ * grow_burst_allocs heap allocations apart) and halves again once they are
+ * grow_idle_allocs apart, staying between chunksize and chunk_max_size.
+ * It is also capped relative to the heap size, so the unused memory at
+ * the end of a small heap stays small
+ *
+ * @param[in] asize
+ * @return The extension size, at least asize
+ */
+static size_t grow_size(size_t asize) {
+    size_t since = seg_index->alloc_count - seg_index->grow_alloc;
+    size_t chunk = seg_index->chunk;
+
+    if (since < grow_burst_allocs) {
+        chunk = (chunk < chunk_max_size) ? 2 * chunk : chunk_max_size;
+    } else if (since >= grow_idle_allocs && chunk > chunksize) {
+        chunk /= 2;
+    }
+    seg_index->chunk = chunk;
+    seg_index->grow_alloc = seg_index->alloc_count;
+
+    size_t heap_size = mem_arena_size(seg_index->arena);
+    size_t heap_cap = round_up(heap_size >> chunk_heap_shift, dsize);
+    if (chunk > heap_cap) {
+        chunk = max(heap_cap, chunksize);
+    }
+    return max(asize, chunk);
+}
+
+/**
+ * @brief Finds the free block right before the epilogue, if there is one.
+ * @return The trailing free block, or NULL if the last block is alloced
+ */
+static block_t *find_tail_free(void) {
+    block_t *epilogue =
+        (block_t *)((char *)mem_arena_hi(seg_index->arena) + 1 - wsize);
+    if (get_prev_alloc(epilogue)) {
+        return NULL;
+    }
+    return get_prev_mini(epilogue)
+               ? (block_t *)((char *)epilogue - min_block_size)
+               : footer_to_header(find_prev_footer(epilogue));
+}
+
+/**
+ * @brief
+ *
+ * Makes room for asize bytes at the end of the heap. A trailing free block
+ * already covers part of the request, so the heap only grows by the
+ * shortfall (but always by at least the chunk from grow_size)
+ *
+ * @param[in] asize
+ * @return A free block of at least asize bytes, or NULL if the heap could
+ *         not be extended
+ */
+static block_t *grow_heap(size_t asize) {
+    block_t *tail = find_tail_free();
+    size_t available = (tail != NULL) ? get_size(tail) : 0;
+
+    // The bounded fit search may have passed over the trailing block
+    if (available >= asize) {
+        return tail;
+    }
+    return extend_heap(grow_size(asize - available));
+}
+
+/**
+ * @brief
+ *
+ * Gives the end of the heap back to mem_sbrk if block is a large free block
+ * right before the epilogue. It only happens from trim_threshold bytes and
+ * twice the current growth chunk on, and one chunk stays in the heap, so
+ * that the heap does not shrink and grow back over and over
+ *
+ * @param[in] block A free block
+ */
+static void trim_heap(block_t *block) {
+    dbg_requires(!get_alloc(block));
+    size_t size = get_size(block);
+    size_t keep = seg_index->chunk;
+
+    if (size < trim_threshold || size < 2 * keep ||
+        get_size(find_next(block)) != 0) {
+        return;
+    }
+
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+    remove_from_free_list(block);
+    lock_sbrk();
+    void *old_brk = mem_arena_sbrk(seg_index->arena, -(intptr_t)(size - keep));
+    unlock_sbrk();
+    if (old_brk == (void *)-1) {
+        add_to_free_list(block);
+        return;
+    }
+
+    write_epilogue((block_t *)((char *)block + keep), false);
+    write_block(block, keep, false, prev_alloc, prev_mini);
+    add_to_free_list(block);
+
+    // Memory past the new end is gone (and zero if the heap grows back)
+    char *heap_end = (char *)mem_arena_hi(seg_index->arena) + 1;
+    if (seg_index->zero_start > heap_end) {
+        seg_index->zero_start = heap_end;
+    }
+}
+
+/**
+ * @brief
+ *
+ * Moves zero_start past an alloced block, which the user may now write to,
+ * and past the header and free-block fields of the block after it
+ *
+ * @param[in] block
+ */
+static void advance_zero_start(block_t *block) {
+    char *used_end = (char *)find_next(block) + sizeof(block_t);
+    if (used_end > seg_index->zero_start) {
+        seg_index->zero_start = used_end;
+    }
+}
+
+/**
+ * @brief
+ *
+ * Splits a free block in the heap into an alloced
+ * block and a free block if there is available space to spare
+ *
+ * @param[in] block
+ * @param[in] asize
+ */
+static void split_block(block_t *block, size_t asize) {
+    // asize: size of the block we want to allocate
+    // if block larger than asize, we can reuse some of that leftover space
+
+    // This takes in an alloced block! And trying to spare some space
+    dbg_requires(get_alloc(block));
+    dbg_requires(get_size(block) >=
+                 asize); // cannot have block be bigger than space we put it in
+
+    size_t block_size = get_size(block);
+    if ((block_size - asize) >= min_block_size) {
+        // Big block was already removed from free list
+
+        // 1. mark large block's initial chunk as alloc (on heap)
+        block_t *block_next;
+        write_block(block, asize, true, get_prev_alloc(block),
+                    get_prev_mini(block)); // adding mini blocks
+
+        dbg_printf("\n split block 1 size: %lu", get_size(block));
+
+        // 2.1 mark second chunk as free (on heap)
+        block_next = find_next(block);
+        write_block(block_next, block_size - asize, false, true,
+                    get_size(block) == min_block_size); // mini block update
+
+        // 2.2 re add onto free list new smaller chunk
+        dbg_printf("\n block size - asize: %lu", block_size - asize);
+        add_to_free_list(block_next);
+
+        if (get_size(block_next) == 16) {
+            dbg_assert(get_prev_free(block_next) == NULL); // LIFO: new head
+            dbg_assert(get_prev_mini(find_next(block_next)) == 1);
+        }
+
+        dbg_ensures(!get_alloc(block_next));
+    }
+    dbg_ensures(get_alloc(block));
+}
+
+/**
+ * @brief
+ *
+ * Finds the first fit in the free list for a specific size
+ *
+ * @param[in] asize
+ * @return
+ */
+static block_t *find_fit(size_t asize) {
+    // Large sizes only fit blocks in the tree
+    if (asize >= tree_min_size) {
+        return tree_best_fit(asize);
+    }
+
+    // SEG LIST IMPLEMENTATION
+    // (mini blocks are the class of size 16, no special case needed)
+
+    // Determine seg class that block belongs to
+    size_t fl, sl;
+    determine_seg_class(asize, &fl, &sl);
+
+    // 1. Look in its own class: not every block there is big enough.
+    // Keep the best fit among at most fit_search_limit + 1 blocks, so
+    // the walk is bounded however long the list is
+    size_t counter = 0;
+    size_t best_size = 0;
+    block_t *best_fit = NULL;
+
+    for (block_t *block = seg_index->heads[fl][sl];
+         block != NULL && counter <= fit_search_limit;
+         block = block->next_free) {
+        size_t available_size = get_size(block);
+        if (available_size >= asize &&
+            (best_fit == NULL || available_size < best_size)) {
+            best_fit = block;
+            best_size = available_size;
+
+            // can't do better than an exact fit
+            if (best_size == asize)
+                break;
+        }
+        counter++;
+    }
+
+    if (best_fit != NULL) {
+        return best_fit;
+    }
+
+    // 2. Any block in a larger class fits: take the head of the first
+    // non-empty one, found by bit scanning instead of walking lists
+    unsigned int sl_map =
+        seg_index->sl_bitmap[fl] & (~0u << (sl + 1)); // higher sl only
+    if (sl_map == 0) {
+        word_t fl_map =
+            (fl + 1 < FL_INDEX_COUNT)
+                ? seg_index->fl_bitmap & (~(word_t)0 << (fl + 1))
+                : 0;
+        if (fl_map == 0) {
+            // every block in the tree fits
+            return tree_best_fit(asize);
+        }
+        fl = find_lsb(fl_map);
+        sl_map = seg_index->sl_bitmap[fl];
+    }
+    sl = find_lsb(sl_map);
+
+    dbg_assert(seg_index->heads[fl][sl] != NULL);
+    dbg_assert(get_size(seg_index->heads[fl][sl]) >= asize);
+    return seg_index->heads[fl][sl];
+}
+
+/**
+ * @brief
+ *
+ * Tries to resize an alloced block to asize without moving it: absorbs the
+ * next block if it is free, extends the heap if the block is the last one,
+ * then splits off whatever is left over
+ *
+ * @param[in] block
+ * @param[in] asize
+ * @return true if block now has room for asize bytes
+ */
+static bool resize_in_place(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block));
+
+    block_t *next = find_next(block);
+    size_t block_size = get_size(block);
+
+    // 1. Last block in the heap (maybe followed by a trailing free block):
+    // grow the heap right behind it
+    size_t available_size = block_size;
+    block_t *after_next = next;
+    if (!get_alloc(next)) {
+        available_size += get_size(next);
+        after_next = find_next(next);
+    }
+    if (available_size < asize && get_size(after_next) == 0) {
+        // Grow by a whole chunk, like malloc does
+        if (extend_heap(grow_size(asize - available_size)) == NULL) {
+            return false;
+        }
+        // the new memory was coalesced with the trailing free block
+        next = find_next(block);
+    }
+
+    // 2. Absorb the next block if it is free. When shrinking, this also
+    // keeps the split off tail from sitting next to another free block
+    if (!get_alloc(next) && block_size + get_size(next) >= asize) {
+        remove_from_free_list(next);
+        block_size += get_size(next);
+        write_block(block, block_size, true, get_prev_alloc(block),
+                    get_prev_mini(block)); // mini block update
+    }
+
+    if (block_size < asize) {
+        return false;
+    }
+
+    // 3. Give back the leftover space
+    split_block(block, asize);
+    advance_zero_start(block);
+    return true;
+}
+
+/**
+ * @brief Finds the quick list for blocks of the given size.
+ * @param[in] size A block size between quick_min_size and quick_max_size
+ * @return
+ */
+static size_t quick_index(size_t size) {
+    dbg_requires(size >= quick_min_size && size <= quick_max_size);
+    return (size - quick_min_size) / dsize;
+}
+
+/**
+ * @brief Number of blocks past which a quick list is flushed.
+ * @param[in] q
+ * @return
+ */
+static size_t quick_limit(size_t q) {
+    size_t count = quick_list_bytes / (quick_min_size + q * dsize);
+    return count > quick_list_limit ? count : quick_list_limit;
+}
+
+/**
+ * @brief
+ *
+ * Frees and coalesces every block on a quick list, emptying it. The list
+ * is detached under its lock, and the blocks freed under the heap lock,
+ * which the caller holds
+ *
+ * @param[in] q
+ */
+static void flush_quick(size_t q) {
+    lock_quick(q);
+    block_t *block = seg_index->quick[q];
+    seg_index->quick[q] = NULL;
+    seg_index->quick_count[q] = 0;
+    unlock_quick(q);
+
+    while (block != NULL) {
+        block_t *next = block->next_free;
+        write_block(block, get_size(block), false, get_prev_alloc(block),
+                    get_prev_mini(block)); // mini block update
+        coalesce_block(block);
+        block = next;
+    }
+
+    // Blocks freed by other threads go too
+    void *bp = take_remote(SLAB_CLASS_COUNT + q);
+    while (bp != NULL) {
+        void *next = *(void **)bp;
+        block = payload_to_header(bp);
+        write_block(block, get_size(block), false, get_prev_alloc(block),
+                    get_prev_mini(block)); // mini block update
+        coalesce_block(block);
+        bp = next;
+    }
+}
+
+/**
+ * @brief
+ *
+ * Puts a freed block on its quick list, without coalescing it. The list is
+ * flushed once it holds more than quick_limit blocks
+ *
+ * @param[in] block An alloced block between quick_min_size and
+ *                  quick_max_size bytes
+ */
+static void push_quick(block_t *block) {
+    size_t q = quick_index(get_size(block));
+    lock_quick(q);
+    block->next_free = seg_index->quick[q];
+    seg_index->quick[q] = block;
+    seg_index->quick_count[q]++;
+    bool full = seg_index->quick_count[q] > quick_limit(q);
+    unlock_quick(q);
+
+    if (full) {
+        lock_heap();
+        flush_quick(q);
+        unlock_heap();
+    }
+}
+
+/**
+ * @brief Takes a block of exactly asize bytes off its quick list.
+ * @param[in] asize
+ * @return The block (still marked alloced), or NULL if there is none
+ */
+static block_t *pop_quick(size_t asize) {
+    if (asize < quick_min_size || asize > quick_max_size) {
+        return NULL;
+    }
+    size_t q = quick_index(asize);
+    lock_quick(q);
+    block_t *block = seg_index->quick[q];
+    if (block != NULL) {
+        seg_index->quick[q] = block->next_free;
+        seg_index->quick_count[q]--;
+    }
+    unlock_quick(q);
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * Finds (or makes room for) a free block of at least asize bytes, marks it
+ * as alloced and splits off the leftover space. The caller holds the heap
+ * lock, and has already tried the quick list of that size (pop_quick)
+ *
+ * @param[in] asize
+ * @return The alloced block, or NULL if the heap could not be extended
+ */
+static block_t *alloc_block(size_t asize) {
+    block_t *block;
+
+    seg_index->alloc_count++;
+
+    // Search the free list for a fit
+    block = find_fit(asize);
+
+    // Before growing the heap, see what the quick lists free up
+    if (block == NULL) {
+        for (size_t q = 0; q < QUICK_CLASS_COUNT; q++) {
+            flush_quick(q);
+        }
+        block = find_fit(asize);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        block = grow_heap(asize);
+        // grow_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // we remove big chunk from free_list, and readd smaller chunk in
+    // split_block (before marking it: a free mini block's header holds its
+    // list pointer)
+    remove_from_free_list(block);
+
+    // Mark block as allocated
+    size_t block_size = get_size(block);
+    write_block(block, block_size, true, get_prev_alloc(block),
+                get_prev_mini(block)); // mini block update
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    // Try to split the block if too large
+    split_block(block, asize);
+    // SPLIT BLOCK TAKES CARE OF MARKING AS FREE OR NOT, AS WELL AS EDITING FREE
+    // LIST
+
+    return block;
+}
+
+/**
+ * @brief Size of the objects of a slab class (bytes).
+ * @param[in] c
+ * @return
+ */
+static size_t slab_object_size(size_t c) {
+    return (c + 1) * dsize;
+}
+
+/**
+ * @brief Number of objects a run of slab class c holds.
+ * @param[in] c
+ * @return
+ */
+static size_t run_capacity(size_t c) {
+    return (run_size - sizeof(slab_run_t)) / slab_object_size(c);
+}
+
+/**
+ * @brief
+ *
+ * Finds the slab run an object belongs to. Only runs are ever placed in
+ * the slab arena's reserved space, so the address alone tells: nothing the
+ * user writes is read, and slab_lo and slab_end don't change after mm_init
+ *
+ * @param[in] bp A pointer returned by malloc
+ * @return The run bp was carved from, or NULL if bp is the payload of a
+ *         regular block or a region
+ */
+static slab_run_t *find_run(void *bp) {
+    if ((char *)bp < seg_index->slab_lo || (char *)bp >= seg_index->slab_end) {
+        return NULL;
+    }
+
+    slab_run_t *run = (slab_run_t *)((word_t)bp & ~(word_t)(run_size - 1));
+    dbg_assert(run->slab_class < SLAB_CLASS_COUNT);
+    dbg_assert((size_t)((char *)bp - run->objects) %
+                   slab_object_size(run->slab_class) ==
+               0);
+    return run;
+}
+
+/**
+ * @brief
+ *
+ * Adds a run to its class's list of runs with free objects. The list is
+ * kept in address order (as far as a walk of fit_search_limit runs goes),
+ * so objects pack into the lowest runs and the higher ones get a chance to
+ * empty out and be given back
+ *
+ * @param[in] run
+ */
+static void push_run(slab_run_t *run) {
+    slab_run_t *prev = NULL;
+    slab_run_t *next = seg_index->slab_runs[run->slab_class];
+    size_t counter = 0;
+    while (next != NULL && next < run && counter < fit_search_limit) {
+        prev = next;
+        next = next->next_run;
+        counter++;
+    }
+
+    run->prev_run = prev;
+    run->next_run = next;
+    if (next != NULL) {
+        next->prev_run = run;
+    }
+    if (prev != NULL) {
+        prev->next_run = run;
+    } else {
+        seg_index->slab_runs[run->slab_class] = run;
+    }
+}
+
+/**
+ * @brief Removes a run from its class's list of runs with free objects.
+ * @param[in] run
+ */
+static void unlink_run(slab_run_t *run) {
+    if (run->prev_run != NULL) {
+        run->prev_run->next_run = run->next_run;
+    } else {
+        seg_index->slab_runs[run->slab_class] = run->next_run;
+    }
+    if (run->next_run != NULL) {
+        run->next_run->prev_run = run->prev_run;
+    }
+}
+
+/**
+ * @brief Adds an empty run to the list of free runs.
+ * @param[in] run
+ */
+static void push_free_run(slab_run_t *run) {
+    run->slab_class = SLAB_CLASS_COUNT;
+    run->prev_run = NULL;
+    run->next_run = seg_index->free_runs;
+    if (run->next_run != NULL) {
+        run->next_run->prev_run = run;
+    }
+    seg_index->free_runs = run;
+}
+
+/**
+ * @brief Removes a run from the list of free runs.
+ * @param[in] run
+ */
+static void unlink_free_run(slab_run_t *run) {
+    if (run->prev_run != NULL) {
+        run->prev_run->next_run = run->next_run;
+    } else {
+        seg_index->free_runs = run->next_run;
+    }
+    if (run->next_run != NULL) {
+        run->next_run->prev_run = run->prev_run;
+    }
+}
+
+/**
+ * @brief
+ *
+ * Gets memory for a run: a free run if there is one, or run_size more bytes
+ * of the slab arena. The caller holds the heap lock
+ *
+ * @return The run, or NULL if the slab arena is full
+ */
+static slab_run_t *alloc_run(void) {
+    slab_run_t *run = seg_index->free_runs;
+    if (run != NULL) {
+        unlink_free_run(run);
+        return run;
+    }
+
+    // The arena is only grown within its reserved space, where find_run
+    // looks; past it, mem_arena_sbrk would fail (and say so)
+    mem_arena_t *arena = seg_index->slab_arena;
+    if (arena == NULL ||
+        (char *)mem_arena_hi(arena) + 1 + run_size > seg_index->slab_end) {
+        return NULL;
+    }
+    lock_sbrk();
+    run = mem_arena_sbrk(arena, (intptr_t)run_size);
+    unlock_sbrk();
+    return run == (void *)-1 ? NULL : run;
+}
+
+/**
+ * @brief
+ *
+ * Gives back the memory of an empty run. The runs at the top of the slab
+ * arena go back to memlib, the others wait on the list of free runs. The
+ * caller holds the heap lock
+ *
+ * @param[in] run
+ */
+static void release_run(slab_run_t *run) {
+    mem_arena_t *arena = seg_index->slab_arena;
+    char *top = (char *)mem_arena_hi(arena) + 1;
+    if ((char *)run + run_size != top) {
+        push_free_run(run);
+        return;
+    }
+
+    // Free runs right below it go too
+    size_t size = run_size;
+    slab_run_t *below = (slab_run_t *)((char *)run - run_size);
+    while ((char *)below >= seg_index->slab_lo &&
+           below->slab_class == SLAB_CLASS_COUNT) {
+        unlink_free_run(below);
+        size += run_size;
+        below = (slab_run_t *)((char *)below - run_size);
+    }
+    lock_sbrk();
+    void *old_brk = mem_arena_sbrk(arena, -(intptr_t)size);
+    unlock_sbrk();
+    if (old_brk == (void *)-1) {
+        // The runs stay, as free runs
+        for (char *p = top - size; p < top; p += run_size) {
+            push_free_run((slab_run_t *)p);
+        }
+    }
+}
+
+/**
+ * @brief
+ *
+ * Sets up a new, empty run for slab class c and puts it on the class's list
+ *
+ * @param[in] c
+ * @return The new run, or NULL if the slab arena is full
+ */
+static slab_run_t *new_run(size_t c) {
+    lock_heap();
+    slab_run_t *run = alloc_run();
+    if (run != NULL) {
+        // release_run reads the classes of other runs under the heap lock
+        run->slab_class = (uint32_t)c;
+    }
+    unlock_heap();
+    if (run == NULL) {
+        return NULL;
+    }
+
+    run->used = 0;
+
+    // Slots past the capacity are marked alloced so they are never handed out
+    size_t capacity = run_capacity(c);
+    for (size_t w = 0; w < RUN_BITMAP_WORDS; w++) {
+        size_t first = w * 64;
+        if (capacity <= first) {
+            run->bitmap[w] = ~(word_t)0;
+        } else if (capacity - first >= 64) {
+            run->bitmap[w] = 0;
+        } else {
+            run->bitmap[w] = ~(word_t)0 << (capacity - first);
+        }
+    }
+
+    push_run(run);
+    return run;
+}
+
+/**
+ * @brief
+ *
+ * Puts a slab object back in its run. A run that becomes empty is given
+ * back (see release_run), unless it is the only run of its class with free
+ * objects. The caller holds the class's lock
+ *
+ * @param[in] run The run bp belongs to
+ * @param[in] bp
+ */
+static void slab_put(slab_run_t *run, void *bp) {
+    size_t c = run->slab_class;
+    size_t i = (size_t)((char *)bp - run->objects) / slab_object_size(c);
+    dbg_assert(run->bitmap[i / 64] & ((word_t)1 << (i % 64)));
+
+    // A full run gets back on the list
+    if (run->used == run_capacity(c)) {
+        push_run(run);
+    }
+    run->bitmap[i / 64] &= ~((word_t)1 << (i % 64));
+    run->used--;
+
+    if (run->used == 0 &&
+        (run->prev_run != NULL || run->next_run != NULL)) {
+        unlink_run(run);
+        lock_heap();
+        release_run(run);
+        unlock_heap();
+    }
+}
+
+/**
+ * @brief
+ *
+ * Takes an object from the first run of slab class c, making a new run if
+ * there is none. The caller holds the class's lock
+ *
+ * @param[in] c
+ * @return The object, or NULL if the slab arena is full
+ */
+static void *slab_take(size_t c) {
+    slab_run_t *run = seg_index->slab_runs[c];
+
+    // Objects freed by other threads may free up a run
+    if (run == NULL) {
+        void *bp = take_remote(c);
+        while (bp != NULL) {
+            void *next = *(void **)bp;
+            slab_put(find_run(bp), bp);
+            bp = next;
+        }
+        run = seg_index->slab_runs[c];
+    }
+
+    if (run == NULL) {
+        run = new_run(c);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    // First free object: first zero bit of the bitmap
+    size_t w = 0;
+    while (run->bitmap[w] == ~(word_t)0) {
+        w++;
+    }
+    dbg_assert(w < RUN_BITMAP_WORDS);
+    size_t bit = find_lsb(~run->bitmap[w]);
+    run->bitmap[w] |= (word_t)1 << bit;
+    run->used++;
+
+    // Full runs leave the list until an object is freed
+    if (run->used == run_capacity(c)) {
+        unlink_run(run);
+    }
+
+    return run->objects + (w * 64 + bit) * slab_object_size(c);
+}
+
+/**
+ * @brief
+ *
+ * Finds the slab class of a request. Only requests whose ordinary block
+ * would be bigger than the class's objects go to runs: the others (up to
+ * wsize bytes past a multiple of dsize) fit a block of the same size
+ *
+ * @param[in] size
+ * @return The class, or SLAB_CLASS_COUNT if size is not served from runs
+ */
+static size_t slab_class(size_t size) {
+    if (size == 0 || size > slab_max_size ||
+        round_up(size + wsize, dsize) <= round_up(size, dsize)) {
+        return SLAB_CLASS_COUNT;
+    }
+    return (size - 1) / dsize;
+}
+
+/**
+ * @brief
+ *
+ * Tells whether slab class c serves requests from runs yet. A run costs
+ * run_size bytes however few objects it holds, so a class only gets runs
+ * once 1/slab_open_div of a run's worth of its requests are live in
+ * ordinary blocks. From then on it keeps them, so the answer may be read
+ * without the class's lock: it can only be out of date by saying no
+ *
+ * @param[in] c
+ * @return
+ */
+static bool slab_opened(size_t c) {
+#ifdef USE_THREADS
+    word_t open = __atomic_load_n(&seg_index->slab_open, __ATOMIC_RELAXED);
+#else
+    word_t open = seg_index->slab_open;
+#endif
+    return (open >> c) & 1;
+}
+
+/**
+ * @brief
+ *
+ * Notes that an ordinary block is freed. If it is the size a request of a
+ * slab class without runs gets, that request no longer counts towards the
+ * class getting runs (a block of another request of that size may be
+ * counted off instead, which only puts the runs off). Classes with runs
+ * don't count, so their frees take no lock here
+ *
+ * @param[in] size The block's size
+ */
+static void slab_forget(size_t size) {
+    if (size < 2 * dsize || size > slab_max_size + dsize) {
+        return;
+    }
+
+    // Requests of class c get blocks of (c + 2) * dsize bytes
+    size_t c = size / dsize - 2;
+    if (slab_opened(c)) {
+        return;
+    }
+    lock_slab(c);
+    if (!slab_opened(c) && seg_index->slab_demand[c] > 0) {
+        seg_index->slab_demand[c]--;
+    }
+    unlock_slab(c);
+}
+
+/**
+ * @brief
+ *
+ * Allocates an object from the slab class that fits size bytes. Until the
+ * class has runs, this counts the request towards it getting them
+ *
+ * @param[in] size
+ * @return The object, or NULL if size has no class or the class has no
+ *         runs yet (the request then gets an ordinary block), or if the
+ *         slab arena is full
+ */
+static void *slab_malloc(size_t size) {
+    size_t c = slab_class(size);
+    if (c == SLAB_CLASS_COUNT) {
+        return NULL;
+    }
+
+    void *bp = NULL;
+    lock_slab(c);
+    if (slab_opened(c)) {
+        bp = slab_take(c);
+    } else if (++seg_index->slab_demand[c] >=
+               run_capacity(c) / slab_open_div) {
+#ifdef USE_THREADS
+        __atomic_fetch_or(&seg_index->slab_open, (word_t)1 << c,
+                          __ATOMIC_RELAXED);
+#else
+        seg_index->slab_open |= (word_t)1 << c;
+#endif
+    }
+    unlock_slab(c);
+    return bp;
+}
+
+/**
+ * @brief Frees a slab object.
+ * @param[in] run The run bp belongs to
+ * @param[in] bp
+ */
+static void slab_free(slab_run_t *run, void *bp) {
+    size_t c = run->slab_class;
+    lock_slab(c);
+    slab_put(run, bp);
+    unlock_slab(c);
+}
+
+#ifdef USE_THREADS
+/**
+ * @brief Finds the thread cache bin for a request.
+ * @param[in] size The requested size, in bytes
+ * @return The bin, or TCACHE_BIN_COUNT if such requests are not cached
+ */
+static size_t tcache_bin(size_t size) {
+    if (size == 0) {
+        return TCACHE_BIN_COUNT;
+    }
+    if (size <= slab_max_size) {
+        size_t c = slab_class(size);
+        return c == SLAB_CLASS_COUNT ? TCACHE_BIN_COUNT : c;
+    }
+    size_t asize = round_up(size + wsize, dsize);
+    if (size > quick_max_size || asize > quick_max_size) {
+        return TCACHE_BIN_COUNT;
+    }
+    return SLAB_CLASS_COUNT + quick_index(asize);
+}
+
+/**
+ * @brief
+ *
+ * Number of objects past which a bin sends half of them back: as many as
+ * fit in tcache_bin_bytes, between 4 and tcache_bin_limit
+ *
+ * @param[in] b
+ * @return
+ */
+static size_t tcache_high_water(size_t b) {
+    size_t size = b < SLAB_CLASS_COUNT
+                      ? slab_object_size(b)
+                      : quick_min_size + (b - SLAB_CLASS_COUNT) * dsize;
+    size_t count = tcache_bin_bytes / size;
+    return count < 4 ? 4 : (count > tcache_bin_limit ? tcache_bin_limit
+                                                     : count);
+}
+
+/**
+ * @brief
+ *
+ * Moves up to n objects from the shared runs or quick list into a bin,
+ * taking the class's lock once
+ *
+ * @param[in] tc
+ * @param[in] b
+ * @param[in] n
+ */
+static void tcache_refill(tcache_t *tc, size_t b, size_t n) {
+    if (b < SLAB_CLASS_COUNT) {
+        lock_slab(b);
+        // Until the class has runs, malloc hands out ordinary blocks
+        if (!slab_opened(b)) {
+            n = 0;
+        }
+        for (; n > 0; n--) {
+            void *bp = slab_take(b);
+            if (bp == NULL) {
+                break;
+            }
+            *(void **)bp = tc->head[b];
+            tc->head[b] = bp;
+            tc->count[b]++;
+        }
+        unlock_slab(b);
+        return;
+    }
+
+    // Quick lists only hand over what they have: new blocks are carved one
+    // at a time by malloc
+    size_t q = b - SLAB_CLASS_COUNT;
+    lock_quick(q);
+    for (; n > 0 && seg_index->quick[q] != NULL; n--) {
+        block_t *block = seg_index->quick[q];
+        seg_index->quick[q] = block->next_free;
+        seg_index->quick_count[q]--;
+        void *bp = header_to_payload(block);
+        *(void **)bp = tc->head[b];
+        tc->head[b] = bp;
+        tc->count[b]++;
+    }
+    unlock_quick(q);
+}
+
+/**
+ * @brief
+ *
+ * Moves n objects from a bin back to the shared runs or quick list, taking
+ * the class's lock once
+ *
+ * @param[in] tc
+ * @param[in] b
+ * @param[in] n At most tc->count[b]
+ */
+static void tcache_drain(tcache_t *tc, size_t b, size_t n) {
+    dbg_requires(n <= tc->count[b]);
+    tc->count[b] -= (uint32_t)n;
+
+    if (b < SLAB_CLASS_COUNT) {
+        lock_slab(b);
+        for (; n > 0; n--) {
+            void *bp = tc->head[b];
+            tc->head[b] = *(void **)bp;
+            slab_put(find_run(bp), bp);
+        }
+        unlock_slab(b);
+        return;
+    }
+
+    size_t q = b - SLAB_CLASS_COUNT;
+    lock_quick(q);
+    for (; n > 0; n--) {
+        void *bp = tc->head[b];
+        tc->head[b] = *(void **)bp;
+        block_t *block = payload_to_header(bp);
+        block->next_free = seg_index->quick[q];
+        seg_index->quick[q] = block;
+        seg_index->quick_count[q]++;
+    }
+    bool full = seg_index->quick_count[q] > quick_limit(q);
+    unlock_quick(q);
+
+    if (full) {
+        lock_heap();
+        flush_quick(q);
+        unlock_heap();
+    }
+}
+
+/**
+ * @brief
+ *
+ * Gives back everything in the cache of an exiting thread, and the cache
+ * itself
+ *
+ * @param[in] arg The thread's cache
+ */
+static void tcache_destroy(void *arg) {
+    // The cache went away with the heap if it has been reset since
+    if (arg != tcache || tcache_epoch != heap_epoch) {
+        return;
+    }
+    tcache = NULL;
+
+    tcache_t *tc = (tcache_t *)arg;
+    for (size_t b = 0; b < TCACHE_BIN_COUNT; b++) {
+        tcache_drain(tc, b, tc->count[b]);
+    }
+    free(tc);
+}
+
+/** @brief Creates the key whose destructor frees the thread caches */
+static void make_tcache_key(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/**
+ * @brief Finds the calling thread's cache.
+ * @param[in] create Whether to set up a cache if the thread has none
+ * @return The cache, or NULL
+ */
+static tcache_t *tcache_get(bool create) {
+    if (tcache != NULL && tcache_epoch == heap_epoch) {
+        return tcache;
+    }
+    tcache = NULL;
+    if (!create) {
+        return NULL;
+    }
+
+    pthread_once(&tcache_key_once, make_tcache_key);
+    lock_heap();
+    block_t *block = alloc_block(round_up(sizeof(tcache_t) + wsize, dsize));
+    if (block != NULL) {
+        advance_zero_start(block);
+    }
+    unlock_heap();
+    if (block == NULL) {
+        return NULL;
+    }
+
+    tcache = (tcache_t *)header_to_payload(block);
+    memset(tcache, 0, sizeof(tcache_t));
+    tcache_epoch = heap_epoch;
+    pthread_setspecific(tcache_key, tcache);
+    return tcache;
+}
+#endif
+
+/**
+ * @brief
+ *
+ * Allocates a small object from the calling thread's cache, refilling an
+ * empty bin with a batch of half its high-water mark
+ *
+ * @param[in] size
+ * @return The object, or NULL if size is not cached or there is none (and
+ *         always NULL in single-threaded builds)
+ */
+static void *tcache_malloc(size_t size) {
+#ifdef USE_THREADS
+    size_t b = tcache_bin(size);
+    if (b == TCACHE_BIN_COUNT) {
+        return NULL;
+    }
+    tcache_t *tc = tcache_get(true);
+    if (tc == NULL) {
+        return NULL;
+    }
+
+    // Objects other threads freed come back first, without a lock
+    if (tc->count[b] == 0) {
+        void *bp = take_remote(b);
+        while (bp != NULL) {
+            void *next = *(void **)bp;
+            *(void **)bp = tc->head[b];
+            tc->head[b] = bp;
+            tc->count[b]++;
+            bp = next;
+        }
+        size_t high = tcache_high_water(b);
+        if (tc->count[b] > high) {
+            tcache_drain(tc, b, tc->count[b] - high / 2);
+        }
+    }
+    if (tc->count[b] == 0) {
+        tcache_refill(tc, b, tcache_high_water(b) / 2);
+    }
+    void *bp = tc->head[b];
+    if (bp != NULL) {
+        tc->head[b] = *(void **)bp;
+        tc->count[b]--;
+    }
+    return bp;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+/**
+ * @brief
+ *
+ * Puts a small object in the calling thread's cache. A bin that goes past
+ * its high-water mark sends half of it back
+ *
+ * @param[in] bp A slab object or quick list sized block, still alloced
+ * @param[in] b  Its bin
+ * @return false in single-threaded builds (nothing is done then)
+ */
+static bool tcache_free(void *bp, size_t b) {
+#ifdef USE_THREADS
+    // Threads that never malloc (consumers, or exiting threads) have no
+    // cache. Their frees go on the class's remote-free stack, for the next
+    // thread that mallocs from the class
+    tcache_t *tc = tcache_get(false);
+    if (tc == NULL) {
+        push_remote(b, bp);
+        return true;
+    }
+
+    *(void **)bp = tc->head[b];
+    tc->head[b] = bp;
+    size_t high = tcache_high_water(b);
+    if (++tc->count[b] > high) {
+        tcache_drain(tc, b, tc->count[b] - high / 2);
+    }
+    return true;
+#else
+    (void)bp;
+    (void)b;
+    return false;
+#endif
+}
+
+/**
+ * @brief Tells whether a payload lives in a region instead of the heap.
+ *        Slab objects are outside the heap too, so callers rule them out
+ *        first (see find_run)
+ * @param[in] bp
+ * @return
+ */
+static bool in_region(const void *bp) {
+    // Read without the sbrk lock: the heap's end only moves under the heap
+    // lock, and never past an alloced heap block or onto a region
+    return (const char *)bp < (const char *)mem_arena_lo(seg_index->arena) ||
+           (const char *)bp > (const char *)mem_arena_hi(seg_index->arena);
+}
+
+/**
+ * @brief
+ *
+ * Maps a region for one large block. The region starts with an unused word
+ * and the block header, which keeps the payload aligned; the block size is
+ * the region size minus dsize, so it stays a multiple of dsize
+ *
+ * @param[in] size
+ * @return The payload, or NULL if the region could not be mapped
+ */
+static void *region_malloc(size_t size) {
+    size_t region_size = round_up(size + dsize, mem_pagesize());
+    lock_sbrk();
+    char *region = mem_map(region_size);
+    unlock_sbrk();
+    if (region == (void *)-1) {
+        return NULL;
+    }
+    block_t *block = (block_t *)(region + wsize);
+    block->header = pack(region_size - dsize, true, true, false);
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Unmaps the region of a large block right away.
+ * @param[in] bp
+ */
+static void region_free(void *bp) {
+    block_t *block = payload_to_header(bp);
+    dbg_assert(get_alloc(block));
+    lock_sbrk();
+    mem_unmap((char *)block - wsize, get_size(block) + dsize);
+    unlock_sbrk();
+}
+
+/**
+ * @brief
+ *
+ * Checks a subtree of the size-ordered tree: parent links, free blocks of
+ * tree size, no red node with a red parent, and the same number of black
+ * nodes on every path down
+ *
+ * @param[in] node
+ * @param[in] parent
+ * @return The subtree's black height, or -1 if it is invalid
+ */
+static long tree_black_height(block_t *node, block_t *parent) {
+    if (node == NULL)
+        return 1;
+    if (node->tree_parent != parent || get_alloc(node) ||
+        get_size(node) < tree_min_size)
+        return -1;
+    if (node->tree_red && tree_is_red(parent))
+        return -1;
+
+    long left = tree_black_height(node->tree_left, node);
+    long right = tree_black_height(node->tree_right, node);
+    if (left < 0 || left != right)
+        return -1;
+    return left + (node->tree_red ? 0 : 1);
+}
+
+/**
+ * @brief
+ *
+ * Checks the size-ordered tree: a valid red-black tree with a black root,
+ * whose in-order walk is sorted by size, then address
+ *
+ * @return bool
+ */
+static bool valid_tree() {
+    block_t *root = seg_index->tree_root;
+    if (root == NULL)
+        return true;
+    if (root->tree_red || tree_black_height(root, NULL) < 0)
+        return false;
+
+    block_t *prev = NULL;
+    for (block_t *node = tree_minimum(root); node != NULL;
+         node = tree_next(node)) {
+        if (prev != NULL && !tree_less(prev, node))
+            return false;
+        prev = node;
+    }
+    return true;
 }
 
 /**
  * @brief
  *
- * Splits a free block in the heap into an alloced
- * block and a free block if there is available space to spare
+ * Checks the slab runs: every listed run is a run of its class with a free
+ * object, and its bitmap agrees with its count. Every run in the slab arena
+ * with a free object is listed, and so is every free run
  *
- * @param[in] block
- * @param[in] asize
+ * @return bool
  */
-static void split_block(block_t *block, size_t asize) {
-    // asize: size of the block we want to allocate
-    // if block larger than asize, we can reuse some of that leftover space
-
-    // This takes in an alloced block! And trying to spare some space
-    dbg_requires(get_alloc(block));
-    dbg_requires(get_size(block) >=
-                 asize); // cannot have block be bigger than space we put it in
-
-    size_t block_size = get_size(block);
-    if ((block_size - asize) >= min_block_size) {
-        // Big block was already removed from free list
-
-        // 1. mark large block's initial chunk as alloc (on heap)
-        block_t *block_next;
-        write_block(block, asize, true, get_prev_alloc(block),
-                    get_prev_mini(block)); // adding mini blocks
-
-        dbg_printf("\n split block 1 size: %lu", get_size(block));
-
-        // 2.1 mark second chunk as free (on heap)
-        block_next = find_next(block);
-        write_block(block_next, block_size - asize, false, true,
-                    get_size(block) == min_block_size); // mini block update
+static bool consistent_slabs() {
+    if (seg_index->slab_arena == NULL) {
+        return seg_index->free_runs == NULL;
+    }
+    char *top = (char *)mem_arena_hi(seg_index->slab_arena) + 1;
+    size_t runs = (size_t)(top - seg_index->slab_lo) / run_size;
+    if (seg_index->slab_lo != mem_arena_lo(seg_index->slab_arena) ||
+        top > seg_index->slab_end) {
+        dbg_printf("Slab arena outside its reserved space\n");
+        return false;
+    }
 
-        // 2.2 re add onto free list new smaller chunk
-        dbg_printf("\n block size - asize: %lu", block_size - asize);
-        add_to_free_list(block_next);
+    size_t listed = 0;
+    for (size_t c = 0; c <= SLAB_CLASS_COUNT; c++) {
+        slab_run_t *prev = NULL;
+        slab_run_t *run = c < SLAB_CLASS_COUNT ? seg_index->slab_runs[c]
+                                               : seg_index->free_runs;
+        for (; run != NULL; run = run->next_run) {
+            if ((char *)run < seg_index->slab_lo || (char *)run >= top ||
+                (word_t)run % run_size != 0 || run->slab_class != c ||
+                (c < SLAB_CLASS_COUNT && run->used >= run_capacity(c)) ||
+                run->prev_run != prev) {
+                dbg_printf("Bad run %p on list of class %zu\n", (void *)run,
+                           c);
+                return false;
+            }
+            // a cycle would list more runs than the arena holds
+            if (++listed > runs) {
+                return false;
+            }
+            prev = run;
+        }
+    }
 
-        if (get_size(block_next) == 16) {
-            dbg_assert(mini_list_start == block_next);
-            block_t *epilogue = (block_t *)((char *)(mem_heap_hi()) - 7);
-            dbg_assert(get_prev_mini(epilogue) == 1);
+    size_t partial = 0;
+    for (char *p = seg_index->slab_lo; p < top; p += run_size) {
+        slab_run_t *run = (slab_run_t *)p;
+        size_t c = run->slab_class;
+        if (c == SLAB_CLASS_COUNT) {
+            partial++;
+            continue;
+        }
+        if (c > SLAB_CLASS_COUNT) {
+            dbg_printf("Run %p has no class\n", (void *)run);
+            return false;
         }
 
-        dbg_ensures(!get_alloc(block_next));
+        // bits past the capacity are always set
+        size_t bits = 0;
+        for (size_t w = 0; w < RUN_BITMAP_WORDS; w++) {
+            bits += (size_t)__builtin_popcountl(run->bitmap[w]);
+        }
+        if (bits != run->used + RUN_BITMAP_WORDS * 64 - run_capacity(c)) {
+            dbg_printf("Run %p bitmap disagrees with count\n", (void *)run);
+            return false;
+        }
+        if (run->used < run_capacity(c)) {
+            partial++;
+        }
     }
-    dbg_ensures(get_alloc(block));
+    return partial == listed;
 }
 
 /**
  * @brief
  *
- * Finds fit in mini list
- * @param[in] block
- * @return
+ * Checks the quick lists: each holds quick_count blocks, all alloced and of
+ * the list's size
+ *
+ * @return bool
  */
-static block_t *find_mini_fit(size_t asize) {
-    // if mini list not empty, just get first one
-    if (mini_list_start != NULL) {
-        return mini_list_start;
+static bool consistent_quick_lists() {
+    for (size_t q = 0; q < QUICK_CLASS_COUNT; q++) {
+        size_t count = 0;
+        for (block_t *block = seg_index->quick[q]; block != NULL;
+             block = block->next_free) {
+            if (!get_alloc(block) ||
+                get_size(block) != quick_min_size + q * dsize) {
+                dbg_printf("Bad block %p on quick list %zu\n", (void *)block,
+                           q);
+                return false;
+            }
+            // also stops cycles
+            if (++count > seg_index->quick_count[q]) {
+                return false;
+            }
+        }
+        if (count != seg_index->quick_count[q]) {
+            return false;
+        }
     }
-
-    // otherwise
-    return NULL;
+    return true;
 }
 
 /**
  * @brief
  *
- * Finds the first fit in the free list for a specific size
+ * Checks that the known-zero memory (see zero_start) really is zero
  *
- * @param[in] asize
- * @return
+ * @return bool
  */
-static block_t *find_fit(size_t asize) {
-    // SEG LIST IMPLEMENTATION
-
-    block_t *mini_block_fit = NULL;
-    // check if miniblock
-    if (asize == min_block_size) {
-        mini_block_fit = find_mini_fit(asize);
-    }
-
-    // only go to other pools if no available mini space
-    if (mini_block_fit != NULL) {
-        return mini_block_fit;
-    }
-
-    else { // General case (works)
-        // Determine seg list that block belongs to
-        size_t index = determine_seg_index(asize);
-
-        // Look for it from its block size upwards
-        for (size_t i = index; i < SEG_LIST_LEN; i++) {
-            block_t *seg_free_list_start = segment_list[i];
+static bool zero_memory_clean() {
+    // only meaningful if mem_sbrk hands out zeroed memory
+    if (!mem_sbrk_zeroed())
+        return true;
 
-            for (block_t *block = seg_free_list_start; block != NULL;
-                 block = block->next_free) {
-                size_t available_size = get_size(block);
-                if (available_size >= asize) {
-                    // Found fit!
-                    // Now try to look into next 20 blocks, find better block?
-                    size_t counter = 0;
-                    size_t best_size = available_size;
-                    block_t *best_fit = block;
-
-                    for (block_t *compare_block = block; compare_block != NULL;
-                         compare_block = compare_block->next_free) {
-                        size_t compare_size = get_size(compare_block);
-                        if ((compare_size < best_size) &&
-                            (compare_size >= asize)) {
-                            best_fit = compare_block;
-                            best_size = compare_size;
-                        }
-
-                        // stop at some point
-                        if (counter == 20)
-                            return best_fit;
-
-                        counter++;
-                    }
-
-                    // or if we reach end of seg list before exploring 10 free
-                    // blocks
-                    return best_fit;
-                }
-            }
+    char *zero_end = (char *)mem_arena_hi(seg_index->arena) + 1 - dsize;
+    for (char *p = seg_index->zero_start; p < zero_end; p += wsize) {
+        if (*(word_t *)p != 0) {
+            dbg_printf("Known-zero word at %p is %lx\n", (void *)p,
+                       *(word_t *)p);
+            return false;
         }
     }
-
-    return NULL; // no fit found
+    return true;
 }
 
 /**
@@ -1023,12 +3092,12 @@ static block_t *find_fit(size_t asize) {
  */
 static bool valid_prologue() {
     // edge case: empty heap
-    if (heap_start == NULL)
+    if (!heap_ready())
         return true;
 
     // general case
-    dbg_assert(heap_start != NULL);
-    block_t *prologue = find_prev(heap_start);
+    dbg_assert(heap_ready());
+    block_t *prologue = find_prev(seg_index->heap_start);
     if (get_size(prologue) == 0)
         return true;
     return false;
@@ -1043,10 +3112,10 @@ static bool valid_prologue() {
  */
 static bool valid_epilogue() {
     // edge case: empty heap
-    if (heap_start == NULL)
+    if (!heap_ready())
         return true;
     // general case
-    for (block_t *block = heap_start; get_size(block) >= 0;
+    for (block_t *block = seg_index->heap_start; get_size(block) >= 0;
          block = find_next(block)) {
         if (get_size(block) == 0)
             return true;
@@ -1064,11 +3133,11 @@ static bool valid_epilogue() {
 
 static bool valid_blocks() {
     // edge case: empty heap
-    if (heap_start == NULL)
+    if (!heap_ready())
         return true;
 
     // general case:
-    for (block_t *block = heap_start; get_size(block) > 0;
+    for (block_t *block = seg_index->heap_start; get_size(block) > 0;
          block = find_next(block)) {
         // A. block correct alignment
         if ((uintptr_t)(&(block->payload)) % 16 != 0) {
@@ -1096,17 +3165,18 @@ static bool valid_blocks() {
 
 static bool check_coalescing() {
     // edge case: empty heap
-    if (heap_start == NULL)
+    if (!heap_ready())
         return true;
 
     // general case:
-    for (block_t *block = heap_start; get_size(block) > 0;
+    for (block_t *block = seg_index->heap_start; get_size(block) > 0;
          block = find_next(block)) {
         bool is_free = !get_alloc(block);
         // found a free block
         if (is_free) {
             dbg_assert(block != NULL);
-            bool prev_free = !get_alloc(find_prev(block));
+            // alloc blocks have no footer: use the prev_alloc bit instead
+            bool prev_free = !get_prev_alloc(block);
             bool next_free = !get_alloc(find_next(block));
 
             // can't have consecutive free blocks
@@ -1134,13 +3204,14 @@ static bool check_coalescing() {
 
 static bool consistent_pointers() {
     // loop through each free list
-    for (size_t i = 0; i < SEG_LIST_LEN; i++) {
-        block_t *seg_free_list_start = segment_list[i];
+    for (size_t i = 0; i < FL_INDEX_COUNT * SL_INDEX_COUNT; i++) {
+        block_t *seg_free_list_start =
+            seg_index->heads[i / SL_INDEX_COUNT][i % SL_INDEX_COUNT];
 
         for (block_t *A = seg_free_list_start; A != NULL; A = A->next_free) {
             // first check: between mem_heap_lo() and high()
-            size_t *heap_start_address = mem_heap_lo();
-            size_t *heap_end_address = mem_heap_hi();
+            size_t *heap_start_address = mem_arena_lo(seg_index->arena);
+            size_t *heap_end_address = mem_arena_hi(seg_index->arena);
 
             if ((uintptr_t)A < (uintptr_t)heap_start_address)
                 return false;
@@ -1151,10 +3222,10 @@ static bool consistent_pointers() {
             block_t *B = A->next_free;
             // reached end of list
             if (B == NULL) {
-                return true;
+                break;
             }
             // else
-            if (B->prev_free != A) {
+            if (get_prev_free(B) != A) {
                 dbg_printf("Two astray pointers\n");
                 return false;
             }
@@ -1179,10 +3250,10 @@ static bool list_match_heap() {
     // edge case: empty heap
 
     /* dbg_printf("1: %zu\n", heap_count); */
-    if (heap_start == NULL)
+    if (!heap_ready())
         heap_count = 0;
     else { // general case
-        for (block_t *block = heap_start; get_size(block) > 0;
+        for (block_t *block = seg_index->heap_start; get_size(block) > 0;
              block = find_next(block)) {
             bool is_free = !get_alloc(block);
             if (is_free)
@@ -1195,14 +3266,23 @@ static bool list_match_heap() {
     size_t list_count = 0;
 
     // loop through each free list
-    for (size_t i = 0; i < SEG_LIST_LEN; i++) {
-        block_t *seg_free_list_start = segment_list[i];
+    for (size_t i = 0; i < FL_INDEX_COUNT * SL_INDEX_COUNT; i++) {
+        block_t *seg_free_list_start =
+            seg_index->heads[i / SL_INDEX_COUNT][i % SL_INDEX_COUNT];
         // count free block in each individual list
         for (block_t *A = seg_free_list_start; A != NULL; A = A->next_free) {
             list_count++;
         }
     }
 
+    // plus the tree
+    if (seg_index->tree_root != NULL) {
+        for (block_t *A = tree_minimum(seg_index->tree_root); A != NULL;
+             A = tree_next(A)) {
+            list_count++;
+        }
+    }
+
     // Debugging
     if (heap_count != list_count) {
         dbg_printf("\nHeap count: %zu\n", heap_count);
@@ -1223,8 +3303,9 @@ static bool list_match_heap() {
 
 static bool all_free() {
     // loop through each free list
-    for (size_t i = 0; i < SEG_LIST_LEN; i++) {
-        block_t *seg_free_list_start = segment_list[i];
+    for (size_t i = 0; i < FL_INDEX_COUNT * SL_INDEX_COUNT; i++) {
+        block_t *seg_free_list_start =
+            seg_index->heads[i / SL_INDEX_COUNT][i % SL_INDEX_COUNT];
         // go through blocks in current free list
         for (block_t *A = seg_free_list_start; A != NULL; A = A->next_free) {
             if (get_alloc(A))
@@ -1232,6 +3313,8 @@ static bool all_free() {
         }
     }
 
+    // tree blocks (checked in valid_tree)
+
     // otherwise
     return true;
 }
@@ -1247,8 +3330,9 @@ static bool all_free() {
 static bool no_cycles() {
 
     // loop through each free list
-    for (size_t i = 0; i < SEG_LIST_LEN; i++) {
-        block_t *seg_free_list_start = segment_list[i];
+    for (size_t i = 0; i < FL_INDEX_COUNT * SL_INDEX_COUNT; i++) {
+        block_t *seg_free_list_start =
+            seg_index->heads[i / SL_INDEX_COUNT][i % SL_INDEX_COUNT];
         // go through blocks in current free list
         for (block_t *block = seg_free_list_start; block != NULL;
              block = block->next_free) {
@@ -1264,12 +3348,43 @@ static bool no_cycles() {
 /**
  * @brief
  *
- * For debugging purposes, checks validity of heap
+ * Ensures the index bitmaps agree with the lists: a class bit is set iff its
+ * list is non-empty, and a range bit is set iff any of its classes bits is
+ *
+ * @return bool
+ */
+
+static bool consistent_bitmaps() {
+    for (size_t fl = 0; fl < FL_INDEX_COUNT; fl++) {
+        for (size_t sl = 0; sl < SL_INDEX_COUNT; sl++) {
+            bool has_blocks = seg_index->heads[fl][sl] != NULL;
+            bool sl_bit = (seg_index->sl_bitmap[fl] >> sl) & 1;
+            if (has_blocks != sl_bit)
+                return false;
+        }
+        bool fl_bit = (seg_index->fl_bitmap >> fl) & 1;
+        if (fl_bit != (seg_index->sl_bitmap[fl] != 0))
+            return false;
+    }
+
+    // otherwise
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * For debugging purposes, checks validity of heap. The caller holds every
+ * lock
  *
  * @param[in] line
  * @return
  */
-bool mm_checkheap(int line) {
+static bool check_heap(int line) {
+    // edge case: heap (and its free-list index) not initialized yet
+    if (!heap_ready())
+        return true;
+
     // CHECKING HEAP
     // 1. Check epilogue / prologue
     if (!valid_epilogue()) {
@@ -1319,17 +3434,89 @@ bool mm_checkheap(int line) {
         return false;
     }
 
-    // 4. See if number of heap free blocks match free_list number of blocks
+    // 4. Bitmaps match the lists they summarize
+    if (!consistent_bitmaps()) {
+        dbg_printf("Heap checker error at line %d\n", line);
+        dbg_printf("Index bitmaps disagree with free lists\n");
+        return false;
+    }
+
+    // 5. The tree of large blocks is sound
+    if (!valid_tree()) {
+        dbg_printf("Heap checker error at line %d\n", line);
+        dbg_printf("Invalid size-ordered tree\n");
+        return false;
+    }
+
+    // 6. See if number of heap free blocks match free_list number of blocks
     if (!list_match_heap()) {
         dbg_printf("Heap checker error at line %d\n", line);
         dbg_printf("Invalid list_match_heap\n");
         return false;
     }
 
+    // 7. Slab runs match their lists
+    if (!consistent_slabs()) {
+        dbg_printf("Heap checker error at line %d\n", line);
+        dbg_printf("Invalid slab runs\n");
+        return false;
+    }
+
+    // 8. Quick lists hold what they claim to
+    if (!consistent_quick_lists()) {
+        dbg_printf("Heap checker error at line %d\n", line);
+        dbg_printf("Invalid quick lists\n");
+        return false;
+    }
+
+    // 9. Memory calloc relies on being zero is zero
+    if (!zero_memory_clean()) {
+        dbg_printf("Heap checker error at line %d\n", line);
+        dbg_printf("Dirty known-zero memory\n");
+        return false;
+    }
+
     // Passes all checks
     return true;
 }
 
+/**
+ * @brief
+ *
+ * For debugging purposes, checks validity of heap. Thread-safe builds take
+ * every lock, in lock order, for the duration of the check
+ *
+ * @param[in] line
+ * @return
+ */
+bool mm_checkheap(int line) {
+    // edge case: heap (and its free-list index, with the locks) not
+    // initialized yet
+    if (!heap_ready())
+        return true;
+
+    for (size_t c = 0; c < SLAB_CLASS_COUNT; c++) {
+        lock_slab(c);
+    }
+    lock_heap();
+    for (size_t q = 0; q < QUICK_CLASS_COUNT; q++) {
+        lock_quick(q);
+    }
+    lock_sbrk();
+
+    bool valid = check_heap(line);
+
+    unlock_sbrk();
+    for (size_t q = QUICK_CLASS_COUNT; q > 0; q--) {
+        unlock_quick(q - 1);
+    }
+    unlock_heap();
+    for (size_t c = SLAB_CLASS_COUNT; c > 0; c--) {
+        unlock_slab(c - 1);
+    }
+    return valid;
+}
+
 /**
  * @brief
  *
@@ -1338,40 +3525,86 @@ bool mm_checkheap(int line) {
  * @return
  */
 bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+    // Not ready until the new heap is set up
+    set_seg_index(NULL);
 
-    if (start == (void *)-1) {
+    // Create the initial empty heap, preceded by the free-list index
+    mem_arena_t *arena = mem_arena_default();
+    size_t index_size = round_up(sizeof(seg_index_t), dsize);
+    char *base =
+        (char *)(mem_arena_sbrk(arena, (intptr_t)(index_size + 2 * wsize)));
+
+    if (base == (void *)-1) {
         return false;
     }
+    word_t *start = (word_t *)(base + index_size);
 
     /* // KEY: have to reinitialize free list to NULL */
     /* free_list_start = NULL; */
 
-    // Reinitialize each free list to NULL
-    for (size_t i = 0; i < SEG_LIST_LEN; i++) {
-        segment_list[i] = NULL;
+    // Reinitialize each free list to NULL (and the bitmaps to empty)
+    seg_index_t *index = (seg_index_t *)base;
+    memset(index, 0, sizeof(seg_index_t));
+    index->arena = arena;
+    index->chunk = chunksize;
+
+    // Slab runs go in an arena of their own, which find_run knows them by.
+    // Without one, small requests all get ordinary blocks
+    index->slab_arena = mem_arena_create(slab_arena_size);
+    if (index->slab_arena != NULL) {
+        index->slab_lo = mem_arena_lo(index->slab_arena);
+        index->slab_end = index->slab_lo + slab_arena_size;
+        dbg_assert((word_t)index->slab_lo % run_size == 0);
     }
-
-    // reinitialize mini to null
-    mini_list_start = NULL;
+    set_seg_index(index);
+    init_locks();
+#ifdef USE_THREADS
+    heap_epoch++;
+#endif
 
     start[0] = pack(0, true, false,
                     false); // Heap prologue (block footer) mini block update
     start[1] = pack(0, true, true,
                     false); // Heap epilogue (block header)  mini block update
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
+    // Nothing is known to be zero until the heap is extended
+    seg_index->zero_start = (char *)mem_arena_hi(arena) + 1;
 
     // Extend the empty heap with a free block of chunksize bytes
     if (extend_heap(chunksize) == NULL) {
         return false;
     }
 
+    // Heap starts with first "block header". Set last: other threads take
+    // a non-NULL heap_start to mean the heap is ready
+#ifdef USE_THREADS
+    __atomic_store_n(&seg_index->heap_start, (block_t *)&(start[1]),
+                     __ATOMIC_RELEASE);
+#else
+    seg_index->heap_start = (block_t *)&(start[1]);
+#endif
+
     return true;
 }
 
+/**
+ * @brief Initializes the heap on first use, once even if threads race.
+ * @return false if the heap could not be initialized
+ */
+static bool init_once(void) {
+#ifdef USE_THREADS
+    if (heap_ready()) {
+        return true;
+    }
+    pthread_mutex_lock(&init_lock);
+    bool ready = heap_ready() || mm_init();
+    pthread_mutex_unlock(&init_lock);
+    return ready;
+#else
+    return heap_ready() || mm_init();
+#endif
+}
+
 /**
  * @brief
  *
@@ -1384,17 +3617,14 @@ void *malloc(size_t size) {
     dbg_requires(mm_checkheap(__LINE__));
     dbg_printf("\n Malloc of size: %lu\n", size);
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
+    size_t asize; // Adjusted block size
     block_t *block;
     void *bp = NULL;
 
     // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        if (!(mm_init())) {
-            dbg_printf("Problem initializing heap. Likely due to sbrk");
-            return NULL;
-        }
+    if (!init_once()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return NULL;
     }
 
     // Ignore spurious request
@@ -1403,42 +3633,45 @@ void *malloc(size_t size) {
         return bp;
     }
 
+    // Small requests go to the thread's cache first
+    bp = tcache_malloc(size);
+    if (bp != NULL) {
+        return bp;
+    }
+
+    // Small requests come from slab runs, once their class has them
+    if (size <= slab_max_size) {
+        bp = slab_malloc(size);
+        if (bp != NULL) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+    }
+
+    // Large requests get a region of their own
+    if (size >= region_min_size) {
+        return region_malloc(size);
+    }
+
     // Adjust block size to include overhead and to meet alignment requirements
     /* asize = round_up(size + dsize, dsize); */
     asize = round_up(size + wsize, dsize);
 
-    // Search the free list for a fit
-    block = find_fit(asize);
-
-    // If no fit is found, request more memory, and then and place the block
+    // Quick list blocks were handed out before, so zero_start is past them
+    block = pop_quick(asize);
     if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
+        lock_heap();
+        block = alloc_block(asize);
+        if (block != NULL) {
+            // The user may write anywhere in the block from now on
+            advance_zero_start(block);
+        }
+        unlock_heap();
         if (block == NULL) {
             return bp;
         }
     }
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    write_block(block, block_size, true, get_prev_alloc(block),
-                get_prev_mini(block)); // mini block update
-
-    // we remove big chunk from free_list, and readd smaller chunk in
-    // split_block
-    remove_from_free_list(block);
-
-    dbg_ensures(mm_checkheap(__LINE__));
-    // Try to split the block if too large
-    split_block(block, asize);
-    // SPLIT BLOCK TAKES CARE OF MARKING AS FREE OR NOT, AS WELL AS EDITING FREE
-    // LIST
-
     bp = header_to_payload(block);
     dbg_ensures(mm_checkheap(__LINE__));
     return bp;
@@ -1458,6 +3691,22 @@ void free(void *bp) {
         return;
     }
 
+    // Small objects go back to their run
+    slab_run_t *run = find_run(bp);
+    if (run != NULL) {
+        if (!tcache_free(bp, run->slab_class)) {
+            slab_free(run, bp);
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    // Large blocks give their memory back at once
+    if (in_region(bp)) {
+        region_free(bp);
+        return;
+    }
+
     block_t *block = payload_to_header(bp);
     size_t size = get_size(block);
 
@@ -1466,12 +3715,33 @@ void free(void *bp) {
 
     dbg_printf("\n Called free on block of size: %lu\n", size);
 
+    slab_forget(size);
+
+    // Blocks of quick list sizes wait there instead of being coalesced.
+    // Those of slab sizes skip the thread cache, where each size would
+    // keep a bin's worth of memory idle
+    if (size >= quick_min_size && size <= quick_max_size) {
+        if (size <= slab_max_size ||
+            !tcache_free(bp, SLAB_CLASS_COUNT + quick_index(size))) {
+            push_quick(block);
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    lock_heap();
+
     // Mark the block as free
     write_block(block, size, false, get_prev_alloc(block),
                 get_prev_mini(block)); // mini block update
 
     // Try to coalesce the block with its neighbors
-    coalesce_block(block);
+    block = coalesce_block(block);
+
+    // A big enough free tail goes back to memlib
+    trim_heap(block);
+
+    unlock_heap();
 
     dbg_ensures(mm_checkheap(__LINE__));
 }
@@ -1501,6 +3771,34 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
+    // Try to resize the block where it is first. A slab object can only
+    // stay put if its class is big enough
+    dbg_requires(mm_checkheap(__LINE__));
+    slab_run_t *run = find_run(ptr);
+    if (run != NULL) {
+        copysize = slab_object_size(run->slab_class);
+        if (size <= copysize) {
+            return ptr;
+        }
+    } else if (in_region(ptr)) {
+        // A region stays if the new size still calls for one, and it is
+        // not mostly unused
+        copysize = get_payload_size(block);
+        if (size >= region_min_size && size <= copysize &&
+            size > copysize / 2) {
+            return ptr;
+        }
+    } else {
+        lock_heap();
+        bool resized = resize_in_place(block, round_up(size + wsize, dsize));
+        copysize = get_payload_size(block); // gets size of old payload
+        unlock_heap();
+        if (resized) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return ptr;
+        }
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
 
@@ -1510,7 +3808,6 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
     if (size < copysize) {
         copysize = size;
     }
@@ -1535,7 +3832,7 @@ void *calloc(size_t elements, size_t size) {
     void *bp;
     size_t asize = elements * size;
 
-    if (elements == 0) {
+    if (asize == 0) {
         return NULL;
     }
     if (asize / elements != size) {
@@ -1543,14 +3840,84 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
-    bp = malloc(asize);
-    if (bp == NULL) {
+    // Initialize heap if it isn't initialized
+    if (!init_once()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return NULL;
+    }
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Cached objects are reused, so they are always cleared
+    bp = tcache_malloc(asize);
+    if (bp != NULL) {
+        memset(bp, 0, asize);
+        return bp;
+    }
+
+    // Slab objects are reused, so they are always cleared
+    if (asize <= slab_max_size) {
+        bp = slab_malloc(asize);
+        if (bp != NULL) {
+            memset(bp, 0, asize);
+            return bp;
+        }
+    }
+
+    // Regions are fresh memory
+    if (asize >= region_min_size) {
+        bp = region_malloc(asize);
+        if (bp != NULL && !mem_sbrk_zeroed()) {
+            memset(bp, 0, asize);
+        }
+        return bp;
+    }
+
+    // A block from a quick list has been used before
+    block_t *block = pop_quick(round_up(asize + wsize, dsize));
+    if (block != NULL) {
+        bp = header_to_payload(block);
+        memset(bp, 0, asize);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    lock_heap();
+    block = alloc_block(round_up(asize + wsize, dsize));
+    if (block == NULL) {
+        unlock_heap();
         return NULL;
     }
+    bp = header_to_payload(block);
+
+    // Only bytes below zero_start and the old footer of the last block (if
+    // this block took it) can be dirty. Work out which, under the lock
+    char *start = (char *)bp;
+    char *end = start + asize;
+    char *zero_end = (char *)mem_arena_hi(seg_index->arena) + 1 - dsize;
+    size_t head = 0;
+    char *tail = end;
+    if (!mem_sbrk_zeroed() || seg_index->zero_start >= zero_end) {
+        head = asize;
+    } else {
+        if (start < seg_index->zero_start) {
+            head = (size_t)(seg_index->zero_start - start);
+            head = head < asize ? head : asize;
+        }
+        if (end > zero_end) {
+            tail = start > zero_end ? start : zero_end;
+        }
+    }
+
+    advance_zero_start(block);
+    unlock_heap();
 
     // Initialize all bits to 0
-    memset(bp, 0, asize);
+    memset(start, 0, head);
+    if (tail < end) {
+        memset(tail, 0, (size_t)(end - tail));
+    }
 
+    dbg_ensures(mm_checkheap(__LINE__));
     return bp;
 }
 
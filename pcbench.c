@@ -0,0 +1,197 @@
+/*
+ * pcbench.c - Producer/consumer benchmark for the thread-safe mm.c
+ *
+ * Each pair of threads passes blocks through a ring: the producer mallocs
+ * them and the consumer frees them, so every free is a cross-thread free.
+ * The benchmark runs with 1, 2, 4, ... pairs and reports how many frees per
+ * second all consumers together get through.
+ */
+
+// GNU extensions used: getopt, clock_gettime, rand_r
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* Slots in a pair's ring (a power of two) */
+#define RING_SIZE 1024
+
+/* A pair's ring, written by the producer and read by the consumer */
+typedef struct {
+    void *slot[RING_SIZE];
+    size_t head; // next slot to fill, producer only
+    size_t tail; // next slot to empty, consumer only
+    size_t ops;  // blocks to pass
+    size_t max_size;
+    unsigned int seed;
+    bool failed;
+} ring_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-h] [-p <pairs>] [-n <ops>] [-s <size>]\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-p <pairs> Most producer/consumer pairs (8).\n");
+    fprintf(stderr, "\t-n <ops>   Blocks each pair passes (1000000).\n");
+    fprintf(stderr, "\t-s <size>  Largest block size, in bytes (512).\n");
+}
+
+static size_t atosz_or_usage(const char *arg, const char *prog) {
+    char *end;
+    unsigned long val = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || val == 0) {
+        usage(prog);
+        exit(1);
+    }
+    return (size_t)val;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/*
+ * producer - malloc blocks and put them in the ring, waiting while it is
+ *     full
+ */
+static void *producer(void *arg) {
+    ring_t *ring = arg;
+    for (size_t i = 0; i < ring->ops; i++) {
+        size_t size = 1 + (size_t)rand_r(&ring->seed) % ring->max_size;
+        void *p = mm_malloc(size);
+        if (p == NULL) {
+            ring->failed = true;
+        } else {
+            *(size_t *)p = i; // touch the block, as a real producer would
+        }
+
+        while (i - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+               RING_SIZE) {
+            sched_yield();
+        }
+        ring->slot[i % RING_SIZE] = p;
+        __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * consumer - take blocks out of the ring and free them, waiting while it is
+ *     empty
+ */
+static void *consumer(void *arg) {
+    ring_t *ring = arg;
+    for (size_t i = 0; i < ring->ops; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == i) {
+            sched_yield();
+        }
+        void *p = ring->slot[i % RING_SIZE];
+        if (p != NULL && *(size_t *)p != i) {
+            ring->failed = true;
+        }
+        mm_free(p);
+        __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * run_pairs - run one round with the given number of pairs on a fresh heap
+ *     and return its time in seconds, or a negative time on failure
+ */
+static double run_pairs(size_t pairs, size_t ops, size_t max_size) {
+    ring_t *rings = calloc(pairs, sizeof(ring_t));
+    pthread_t *threads = calloc(2 * pairs, sizeof(pthread_t));
+    if (rings == NULL || threads == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    mem_reset_brk();
+    if (!mm_init()) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+
+    double start = now();
+    for (size_t i = 0; i < pairs; i++) {
+        rings[i].ops = ops;
+        rings[i].max_size = max_size;
+        rings[i].seed = (unsigned int)i + 1;
+        pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+    }
+    bool failed = false;
+    for (size_t i = 0; i < pairs; i++) {
+        pthread_join(threads[2 * i], NULL);
+        pthread_join(threads[2 * i + 1], NULL);
+        failed = failed || rings[i].failed;
+    }
+    double secs = now() - start;
+
+    if (!mm_checkheap(__LINE__)) {
+        failed = true;
+    }
+    free(rings);
+    free(threads);
+    return failed ? -1.0 : secs;
+}
+
+int main(int argc, char **argv) {
+    size_t max_pairs = 8;
+    size_t ops = 1000000;
+    size_t max_size = 512;
+    int c;
+
+    while ((c = getopt(argc, argv, "hp:n:s:")) != EOF) {
+        switch (c) {
+        case 'p':
+            max_pairs = atosz_or_usage(optarg, argv[0]);
+            break;
+        case 'n':
+            ops = atosz_or_usage(optarg, argv[0]);
+            break;
+        case 's':
+            max_size = atosz_or_usage(optarg, argv[0]);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    mem_init(false);
+    printf("%6s %10s %8s %10s %8s\n", "pairs", "frees", "secs", "Kfrees/s",
+           "speedup");
+    double base = 0.0;
+    for (size_t pairs = 1; pairs <= max_pairs; pairs *= 2) {
+        double secs = run_pairs(pairs, ops, max_size);
+        if (secs < 0) {
+            printf("%6zu  FAILED (out of memory or corrupted heap)\n", pairs);
+            mem_deinit();
+            return 1;
+        }
+        double rate = (double)(pairs * ops) / secs;
+        if (pairs == 1) {
+            base = rate;
+        }
+        printf("%6zu %10zu %8.3f %10.0f %7.2fx\n", pairs, pairs * ops, secs,
+               rate / 1e3, rate / base);
+    }
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* perfctr.c
+ * Hardware performance counters for mdriver, through perf_event_open(2).
+ * Each event gets a counter of its own rather than one group, so that an
+ * event the hardware doesn't support only loses its own column.  Counters
+ * count user mode only, which is all an unprivileged process may count
+ * under the default perf_event_paranoid setting.
+ */
+
+#define _GNU_SOURCE 1 // for syscall
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perfctr.h"
+
+const char *const perfctr_names[PC_NUM_COUNTERS] = {
+    "cycles", "instrs", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss"};
+
+/* File descriptor of each counter, or -1 */
+static int fds[PC_NUM_COUNTERS] = {-1, -1, -1, -1, -1, -1};
+
+#ifdef __linux__
+
+/* Build the perf_event_attr config of a cache event that counts read
+   misses */
+static uint64_t cache_miss(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+int perfctr_open(const char **why) {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PC_NUM_COUNTERS] = {
+        [PC_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        [PC_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        [PC_L1D_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D},
+        [PC_LLC_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL},
+        [PC_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB},
+        [PC_BRANCH_MISSES] = {PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    int opened = 0;
+    int err = 0;
+
+    for (int i = 0; i < PC_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].type == PERF_TYPE_HW_CACHE
+                          ? cache_miss(events[i].config)
+                          : events[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1; /* count the -j replay threads too */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0) {
+            err = errno;
+            fds[i] = -1;
+        } else {
+            fds[i] = (int)fd;
+            opened++;
+        }
+    }
+    if (opened == 0 && why != NULL)
+        *why = strerror(err);
+    return opened;
+}
+
+bool perfctr_available(perfctr_id_t id) {
+    return fds[id] >= 0;
+}
+
+void perfctr_start(void) {
+    for (int i = 0; i < PC_NUM_COUNTERS; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void perfctr_stop(double counts[PC_NUM_COUNTERS]) {
+    for (int i = 0; i < PC_NUM_COUNTERS; i++) {
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < PC_NUM_COUNTERS; i++) {
+        uint64_t val[3]; /* value, time enabled, time running */
+        counts[i] = -1.0;
+        if (fds[i] < 0 || read(fds[i], val, sizeof(val)) != sizeof(val))
+            continue;
+        if (val[2] > 0) /* else it never got onto the hardware */
+            counts[i] = (double)val[0] * ((double)val[1] / (double)val[2]);
+    }
+}
+
+void perfctr_close(void) {
+    for (int i = 0; i < PC_NUM_COUNTERS; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+#else /* !__linux__ */
+
+int perfctr_open(const char **why) {
+    if (why != NULL)
+        *why = "perf_event_open is Linux only";
+    return 0;
+}
+
+bool perfctr_available(perfctr_id_t id) {
+    return false;
+}
+
+void perfctr_start(void) {
+}
+
+void perfctr_stop(double counts[PC_NUM_COUNTERS]) {
+    for (int i = 0; i < PC_NUM_COUNTERS; i++)
+        counts[i] = -1.0;
+}
+
+void perfctr_close(void) {
+}
+
+#endif /* __linux__ */
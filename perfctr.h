@@ -0,0 +1,42 @@
+/* Hardware performance counters, through Linux perf_event_open(2) */
+#ifndef PERFCTR_H
+#define PERFCTR_H 1
+
+#include <stdbool.h>
+
+/* The events counted */
+typedef enum {
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_L1D_MISSES,
+    PC_LLC_MISSES,
+    PC_DTLB_MISSES,
+    PC_BRANCH_MISSES,
+    PC_NUM_COUNTERS
+} perfctr_id_t;
+
+/* Short names of the events, for column headers */
+extern const char *const perfctr_names[PC_NUM_COUNTERS];
+
+/* Open a counter for each event, for this thread and the threads it
+   creates from now on.  Returns the number of counters that could be
+   opened; events the kernel or the hardware won't count (in most
+   containers, none of them) are left out.  If none could be opened,
+   *why is set to the reason */
+int perfctr_open(const char **why);
+
+/* Tell whether the counter for an event is open */
+bool perfctr_available(perfctr_id_t id);
+
+/* Zero the open counters and start them */
+void perfctr_start(void);
+
+/* Stop the counters and read them into counts, scaled up for the time
+   the kernel had them multiplexed out.  Events without a counter read
+   as -1 */
+void perfctr_stop(double counts[PC_NUM_COUNTERS]);
+
+/* Close the counters */
+void perfctr_close(void);
+
+#endif
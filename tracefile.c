@@ -365,6 +365,9 @@ trace_t *read_trace(const char *fname, unsigned int verbose) {
             trace->ops[op].type = REALLOC;
             read_alloc_line(&trace->ops[op], REALLOC, line + 1, fname, lineno);
             break;
+        case 'c':
+            read_alloc_line(&trace->ops[op], CALLOC, line + 1, fname, lineno);
+            break;
         case 'f':
             trace->ops[op].type = FREE;
             read_free_line(&trace->ops[op], line + 1, fname, lineno);
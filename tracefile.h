@@ -29,6 +29,7 @@ typedef enum traceopcode_t {
     ALLOC,   /* 'a': call malloc */
     FREE,    /* 'f': call free */
     REALLOC, /* 'r': call realloc */
+    CALLOC,  /* 'c': call calloc (extension; keep out of default traces) */
 } traceopcode_t;
 
 /** Description of a single trace operation (allocator request).  */